@@ -0,0 +1,289 @@
+/**
+ * Author: Dino Ciuffetti - dam2000 at gmail dot com
+ * Home: https://github.com/dam2k/fanChat
+ * Date: 2019-10-27
+ * Whatis: Melopero's FanHat Raspberry Pi FAN controller daemon rethinked from scratch and written in C
+ * Work with: Melopero FAN HAT for Raspberry Pi 4
+ *   https://www.melopero.com/shop/melopero-engineering/melopero-fan-hat-for-raspberry-pi-4/
+ * Requires: PiGpio library: http://abyz.me.uk/rpi/pigpio/ - apt update && apt install libpigpio-dev
+ * Replaces: official fan driver written in python: https://www.melopero.com/fan-hat/
+ * License: MIT License - https://opensource.org/licenses/MIT
+ *
+ * Notes:
+ * The Melopero FAN HAT for Raspberry Pi 4 is a cool (freddo!! :-)) fan driver for Raspberry Pi 4. It works using GPIO PIN 18 that
+ * has hardware driven PWM capabilities. This way they can handle fan speed changing the PIN's duty cycle.
+ * We continuously read the CPU temperature thanks to the /sys/class/thermal/thermal_zone0/temp file and we take care of cooling
+ * the CPU by setting up the right fan speed modulating the pin's PWM attached to the fan hat.
+ * Since I really hate when the fan is always on at low speed, I thinked of using a high and low watermarks.
+ * If the cpu's temperature is below the LW the fan will be shut down, and when the cpu's temperature raises above the HW the fan
+ * will come into play at the right speed. Also, there is a trigger timeout that will fire if the fan is down for more then a few
+ * minutes after the LW event. In this way we can cool down the RPI's temperature a little bit without reaching the HW or
+ * stressing us too much. Enjoy it!!
+ */
+
+/**
+ * Copyright 2019 Dino Ciuffetti - dam2000 at gmail dot com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+ * IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "common.h"
+#include <limits.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "sysfs.h"
+#include "status.h"
+#include "telemetry.h"
+#include "cgroup.h"
+
+// above this temperature, close to where the firmware throttles (80 C), the batch cgroup is slowed down...
+#define CGHIGHTEMP 77.0
+// ...and below this one it is given back its CPU bandwidth
+#define CGLOWTEMP 74.0
+// the CPU bandwidth share changes by this step (%)...
+#define CGSTEP 10
+// ...not more often than this (seconds), so the temperature can react
+#define CGSTEPSECS 5
+// never go below this CPU bandwidth share (%)
+#define CGMINSHARE 10
+// the kernel refuses quotas below this (usecs)
+#define CGMINQUOTAUS 1000
+
+/*
+  The shares are of what the cgroup really used when the limit started (usage_usec in cpu.stat over the last CGSTEPSECS), capped
+  by its own quota: a slice busy on one CPU out of four is slowed down from the first step. The cpu.max found at startup is the
+  administrator's and is written back when the temperature recovers. While a limit is on, that original line is recorded in the
+  state directory: a fanChat killed meanwhile leaves the record, and the next one restores the line from it.
+*/
+static int cpumaxfd=-1, cpustatfd=-1;
+static char cgpath[PATH_MAX];
+static char cgstatefile[PATH_MAX]; // the limit record
+static char orig[64]; // cpu.max as the administrator set it
+static unsigned long long period=100000; // usecs
+static unsigned long long quota; // the administrator's quota, or all the CPUs (usecs per period)
+static unsigned long long base; // the 100% share of this limit: what the cgroup used when it started (usecs per period)
+static unsigned long long usage=0; // usage_usec at the last measure
+static unsigned long long used; // what the cgroup used over the last measure (usecs per period)
+static struct timespec tusage; // last usage measure
+static int share=100; // CPU bandwidth share left (%)
+static struct timespec tstep; // last step
+static unsigned long events=0; // how many times we started limiting
+static double secs=0; // how long the cgroup was limited
+static struct timespec tlast; // last control round
+static atomic_int limited=ATOMIC_VAR_INIT(0); // a limit is on: the record must exist
+
+// parse a cpu.max line "$MAX $PERIOD" into q (0 if $MAX is "max") and per. Return -1 on errors or 0 on success
+static int cgroup_parse(const char *b, unsigned long long *q, unsigned long long *per) {
+	const char *s;
+	
+	if(strncmp(b, "max", 3)==0) {
+		*q=0;
+		s=b+3;
+	} else if((s=sysfs_parseull(b, q))==NULL || *q==0) {
+		return -1;
+	}
+	
+	return (*s==' ' && sysfs_parseull(s, per)!=NULL && *per>0) ? 0 : -1;
+}
+
+// write or remove the limit record, on the telemetry thread if it's running
+static void cgroup_flush(void) {
+	char tmp[PATH_MAX+4];
+	int fd;
+	ssize_t r;
+	
+	if(!atomic_load(&limited)) {
+		if(unlink(cgstatefile)<0 && errno!=ENOENT) tlog(LOG_ERR, "Cannot remove %s: %s", cgstatefile, strerror(errno));
+		return;
+	}
+	snprintf(tmp, sizeof(tmp), "%s.tmp", cgstatefile);
+	fd=open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd<0) {
+		tlog(LOG_ERR, "Cannot write %s: %s", tmp, strerror(errno));
+		return;
+	}
+	r=write(fd, orig, strlen(orig));
+	close(fd);
+	if(r!=(ssize_t)strlen(orig) || rename(tmp, cgstatefile)<0) {
+		tlog(LOG_ERR, "Cannot write %s: %s", cgstatefile, strerror(errno));
+		unlink(tmp);
+	}
+}
+
+// record that a limit is on (l=1) or off (l=0)
+static void cgroup_record(int l) {
+	atomic_store(&limited, l);
+	if(tcall(cgroup_flush)<0) cgroup_flush(); // the queue is full: a lost record would leave the slice limited for good
+}
+
+// measure what the cgroup used since the last time (usecs per period), at least CGSTEPSECS apart
+static void cgroup_measure(const struct timespec *now) {
+	char b[512];
+	const char *s;
+	unsigned long long u;
+	double dt;
+	
+	dt=(now->tv_sec-tusage.tv_sec)+(now->tv_nsec-tusage.tv_nsec)/1e9;
+	if(cpustatfd<0 || dt<CGSTEPSECS) return;
+	if(sysfs_read(cpustatfd, b, sizeof(b))<=0 || (s=strstr(b, "usage_usec"))==NULL || sysfs_parseull(s+10, &u)==NULL) return;
+	if(usage>0 && u>=usage) used=(unsigned long long)((u-usage)/dt*period/1e6);
+	usage=u;
+	tusage=*now;
+}
+
+// write the cgroup CPU bandwidth share s (%)
+static int cgroup_setshare(int s) {
+	char b[80];
+	
+	if(s>=100) {
+		snprintf(b, sizeof(b), "%s", orig);
+	} else {
+		snprintf(b, sizeof(b), "%llu %llu\n", base*s/100, period);
+	}
+	if(sysfs_write(cpumaxfd, b)<0) {
+		tlog(LOG_ERR, "Cannot limit cgroup %s CPU bandwidth: %s", cgpath, strerror(errno));
+		return -1;
+	}
+	share=s;
+	
+	return 0;
+}
+
+/**
+ * Use the cgroup v2 directory path (the batch workloads) as the second actuator, keeping the record of a limit in statefile.
+ * Return -1 on errors or 0 on success
+ */
+int cgroup_setup(const char *path, const char *statefile) {
+	char p[PATH_MAX], b[64], r[sizeof(orig)];
+	unsigned long long q, per;
+	long ncpus;
+	int fd;
+	ssize_t n;
+	
+	snprintf(cgpath, sizeof(cgpath), "%s", path);
+	snprintf(cgstatefile, sizeof(cgstatefile), "%s", statefile);
+	if(snprintf(p, sizeof(p), "%s/cpu.max", path)>=(int)sizeof(p)) {
+		fprintf(stderr, "cgroup path too long: %s\n", path);
+		return -1;
+	}
+	cpumaxfd=sysfs_open(p, O_RDWR);
+	if(cpumaxfd<0) {
+		fprintf(stderr, "Cannot open %s (is the cpu controller enabled for this cgroup?): %s\n", p, strerror(errno));
+		return -1;
+	}
+	if(sysfs_read(cpumaxfd, b, sizeof(b))<=0 || cgroup_parse(b, &q, &period)<0) {
+		fprintf(stderr, "Cannot parse %s\n", p);
+		goto err;
+	}
+	snprintf(orig, sizeof(orig), "%.*s\n", (int)strcspn(b, "\n"), b);
+	// a limit left by a fanChat killed while limiting: its record has the administrator's line
+	fd=open(cgstatefile, O_RDONLY);
+	if(fd>=0) {
+		n=read(fd, r, sizeof(r)-1);
+		close(fd);
+		r[(n>0) ? n : 0]='\0';
+		if(cgroup_parse(r, &q, &per)<0) {
+			fprintf(stderr, "Ignoring invalid cgroup limit record %s\n", cgstatefile);
+		} else {
+			snprintf(orig, sizeof(orig), "%.*s\n", (int)strcspn(r, "\n"), r);
+			period=per;
+			fprintf(stderr, "cgroup %s was left limited (%.*s), restoring %.*s\n", path, (int)strcspn(b, "\n"), b,
+				(int)strcspn(orig, "\n"), orig);
+			if(cgroup_setshare(100)<0) goto err;
+		}
+		unlink(cgstatefile);
+	}
+	ncpus=sysconf(_SC_NPROCESSORS_ONLN);
+	quota=period*((ncpus<1) ? 1 : ncpus);
+	if(q>0 && q<quota) quota=q;
+	base=quota;
+	snprintf(p, sizeof(p), "%s/cpu.stat", path);
+	cpustatfd=sysfs_open(p, O_RDONLY); // without it the shares are of the quota
+	clock_gettime(CLOCK_BOOTTIME, &tlast);
+	tstep=tlast;
+	tusage=tlast;
+	tusage.tv_sec-=CGSTEPSECS;
+	cgroup_measure(&tlast);
+	
+	return 0;
+	
+err:
+	close(cpumaxfd);
+	cpumaxfd=-1;
+	return -1;
+}
+
+/**
+ * Limit the cgroup CPU bandwidth when thermal headroom is running out (temperature T close to the firmware throttling one),
+ * restoring it as the temperature recovers
+ */
+void cgroup_control(double T) {
+	struct timespec now;
+	int s=share;
+	
+	if(cpumaxfd<0) return;
+	clock_gettime(CLOCK_BOOTTIME, &now);
+	if(share<100) secs+=(now.tv_sec-tlast.tv_sec)+(now.tv_nsec-tlast.tv_nsec)/1e9;
+	tlast=now;
+	if(share==100) cgroup_measure(&now);
+	if(now.tv_sec-tstep.tv_sec<CGSTEPSECS) return;
+	
+	if(T>=CGHIGHTEMP && share>CGMINSHARE) {
+		if(share==100) { // steps of what it uses now, or they wouldn't bite
+			base=(used>0 && used<quota) ? used : quota;
+			if(base*CGMINSHARE/100<CGMINQUOTAUS) base=CGMINQUOTAUS*100/CGMINSHARE;
+		}
+		s=share-CGSTEP;
+		if(s<CGMINSHARE) s=CGMINSHARE;
+		if(share==100) {
+			events++;
+			tlog(LOG_WARNING, "Thermal headroom running out. Temp %2.1f C, limiting cgroup %s CPU bandwidth to %d%% of the %.2f CPUs it uses",
+				T, cgpath, s, (double)base/period);
+			cgroup_record(1); // before the limit, so a kill can't leave one without
+		}
+	} else if(T<=CGLOWTEMP && share<100) {
+		s=share+CGSTEP;
+		if(s>=100) {
+			s=100;
+			tlog(LOG_NOTICE, "Temp %2.1f C, cgroup %s CPU bandwidth restored", T, cgpath);
+		}
+	}
+	if(s!=share && cgroup_setshare(s)==0) {
+		tstep=now;
+		if(s==100) cgroup_record(0);
+	}
+}
+
+/**
+ * Append cgroup admission control counters to the status report
+ */
+void cgroup_status(void) {
+	if(cpumaxfd<0) return;
+	status_add("cgroup", "%s", cgpath);
+	status_add("cgroup_share", "%d", share);
+	status_add("cgroup_base_cpus", "%.2f", (double)base/period);
+	status_add("cgroup_events", "%lu", events);
+	status_add("cgroup_seconds", "%.1f", secs);
+}
+
+/**
+ * Give the cgroup back its original CPU bandwidth and close file descriptors
+ */
+void cgroup_restore(void) {
+	if(cpumaxfd<0) return;
+	if(share<100 && cgroup_setshare(100)==0) cgroup_record(0);
+	close(cpumaxfd);
+	cpumaxfd=-1;
+	if(cpustatfd>=0) close(cpustatfd);
+	cpustatfd=-1;
+}
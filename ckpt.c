@@ -0,0 +1,168 @@
+/**
+ * Author: Dino Ciuffetti - dam2000 at gmail dot com
+ * Home: https://github.com/dam2k/fanChat
+ * Date: 2019-10-27
+ * Whatis: Melopero's FanHat Raspberry Pi FAN controller daemon rethinked from scratch and written in C
+ * Work with: Melopero FAN HAT for Raspberry Pi 4
+ *   https://www.melopero.com/shop/melopero-engineering/melopero-fan-hat-for-raspberry-pi-4/
+ * Requires: PiGpio library: http://abyz.me.uk/rpi/pigpio/ - apt update && apt install libpigpio-dev
+ * Replaces: official fan driver written in python: https://www.melopero.com/fan-hat/
+ * License: MIT License - https://opensource.org/licenses/MIT
+ *
+ * Notes:
+ * The Melopero FAN HAT for Raspberry Pi 4 is a cool (freddo!! :-)) fan driver for Raspberry Pi 4. It works using GPIO PIN 18 that
+ * has hardware driven PWM capabilities. This way they can handle fan speed changing the PIN's duty cycle.
+ * We continuously read the CPU temperature thanks to the /sys/class/thermal/thermal_zone0/temp file and we take care of cooling
+ * the CPU by setting up the right fan speed modulating the pin's PWM attached to the fan hat.
+ * Since I really hate when the fan is always on at low speed, I thinked of using a high and low watermarks.
+ * If the cpu's temperature is below the LW the fan will be shut down, and when the cpu's temperature raises above the HW the fan
+ * will come into play at the right speed. Also, there is a trigger timeout that will fire if the fan is down for more then a few
+ * minutes after the LW event. In this way we can cool down the RPI's temperature a little bit without reaching the HW or
+ * stressing us too much. Enjoy it!!
+ */
+
+/**
+ * Copyright 2019 Dino Ciuffetti - dam2000 at gmail dot com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+ * IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "common.h"
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#include "sysfs.h"
+#include "telemetry.h"
+#include "ckpt.h"
+
+#define BOOTIDFILE "/proc/sys/kernel/random/boot_id"
+#define CKPTMAGIC "fanChatC"
+#define CKPTVERSION 2
+
+// what is written
+struct ckptfile {
+	char magic[8];
+	uint32_t version;
+	char bootid[40]; // CLOCK_BOOTTIME times are meaningful only in the same boot
+	double saved; // when (CLOCK_BOOTTIME seconds)
+	struct ckpt c;
+};
+
+static char checkpointfile[PATH_MAX]=CKPTFILE;
+// don't logspam flag for checkpoint errors
+static int cedlsf=0;
+// the checkpoint handed over to the telemetry thread, pending until written
+static struct ckptfile pf;
+static atomic_int pending=ATOMIC_VAR_INIT(0);
+
+static double nows(void) {
+	struct timespec t;
+	
+	clock_gettime(CLOCK_BOOTTIME, &t);
+	return t.tv_sec+t.tv_nsec/1e9;
+}
+
+// store the boot id into b, empty if unknown
+static void bootid(char *b, size_t len) {
+	int fd;
+	
+	memset(b, 0, len);
+	fd=sysfs_open(BOOTIDFILE, O_RDONLY);
+	if(fd<0) return;
+	sysfs_read(fd, b, len);
+	close(fd);
+	b[strcspn(b, "\n")]='\0';
+}
+
+/**
+ * Set the checkpoint file path
+ */
+void ckpt_setfile(const char *path) {
+	snprintf(checkpointfile, sizeof(checkpointfile), "%s", path);
+}
+
+/**
+ * Load the checkpoint into c. Return -1 if there is no fresh checkpoint from this boot, 0 on success
+ */
+int ckpt_load(struct ckpt *c) {
+	struct ckptfile f;
+	char id[sizeof(f.bootid)];
+	double age;
+	ssize_t r;
+	int fd;
+	
+	fd=open(checkpointfile, O_RDONLY);
+	if(fd<0) return -1;
+	r=read(fd, &f, sizeof(f));
+	close(fd);
+	if(r!=sizeof(f) || memcmp(f.magic, CKPTMAGIC, sizeof(f.magic))!=0 || f.version!=CKPTVERSION) return -1;
+	bootid(id, sizeof(id));
+	age=nows()-f.saved;
+	if(id[0]=='\0' || strncmp(id, f.bootid, sizeof(id))!=0 || age<0 || age>CKPTMAXAGESECS) return -1; // another boot or too old
+	*c=f.c;
+	
+	return 0;
+}
+
+// write the checkpoint handed over by ckpt_save()
+static void ckpt_flush(void) {
+	static char id[sizeof(pf.bootid)];
+	char tmp[PATH_MAX+4];
+	ssize_t r;
+	int fd;
+	
+	if(!atomic_load_explicit(&pending, memory_order_acquire)) return;
+	if(id[0]=='\0') bootid(id, sizeof(id)); // it won't change
+	memcpy(pf.bootid, id, sizeof(pf.bootid));
+	snprintf(tmp, sizeof(tmp), "%s.tmp", checkpointfile);
+	fd=open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd<0) {
+		if(cedlsf==0) tlog(LOG_ERR, "Cannot write checkpoint %s: %s", tmp, strerror(errno));
+		cedlsf=1;
+		goto done;
+	}
+	r=write(fd, &pf, sizeof(pf));
+	close(fd);
+	if(r!=sizeof(pf) || rename(tmp, checkpointfile)<0) {
+		if(cedlsf==0) tlog(LOG_ERR, "Cannot write checkpoint %s: %s", checkpointfile, strerror(errno));
+		cedlsf=1;
+		unlink(tmp);
+		goto done;
+	}
+	cedlsf=0;
+	
+done:
+	atomic_store_explicit(&pending, 0, memory_order_release);
+}
+
+/**
+ * Atomically replace the checkpoint with c, written by the telemetry thread if it's running.
+ * Return -1 if the previous one is still being written (c is dropped) or 0 on success
+ */
+int ckpt_save(const struct ckpt *c) {
+	if(atomic_load_explicit(&pending, memory_order_acquire)) return -1;
+	memset(&pf, 0, sizeof(pf));
+	memcpy(pf.magic, CKPTMAGIC, sizeof(pf.magic));
+	pf.version=CKPTVERSION;
+	pf.saved=nows();
+	pf.c=*c;
+	atomic_store_explicit(&pending, 1, memory_order_release);
+	if(tcall(ckpt_flush)<0) {
+		atomic_store_explicit(&pending, 0, memory_order_release);
+		return -1;
+	}
+	
+	return 0;
+}
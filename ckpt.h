@@ -0,0 +1,79 @@
+/**
+ * Author: Dino Ciuffetti - dam2000 at gmail dot com
+ * Home: https://github.com/dam2k/fanChat
+ * Date: 2019-10-27
+ * Whatis: Melopero's FanHat Raspberry Pi FAN controller daemon rethinked from scratch and written in C
+ * Work with: Melopero FAN HAT for Raspberry Pi 4
+ *   https://www.melopero.com/shop/melopero-engineering/melopero-fan-hat-for-raspberry-pi-4/
+ * Requires: PiGpio library: http://abyz.me.uk/rpi/pigpio/ - apt update && apt install libpigpio-dev
+ * Replaces: official fan driver written in python: https://www.melopero.com/fan-hat/
+ * License: MIT License - https://opensource.org/licenses/MIT
+ *
+ * Notes:
+ * The Melopero FAN HAT for Raspberry Pi 4 is a cool (freddo!! :-)) fan driver for Raspberry Pi 4. It works using GPIO PIN 18 that
+ * has hardware driven PWM capabilities. This way they can handle fan speed changing the PIN's duty cycle.
+ * We continuously read the CPU temperature thanks to the /sys/class/thermal/thermal_zone0/temp file and we take care of cooling
+ * the CPU by setting up the right fan speed modulating the pin's PWM attached to the fan hat.
+ * Since I really hate when the fan is always on at low speed, I thinked of using a high and low watermarks.
+ * If the cpu's temperature is below the LW the fan will be shut down, and when the cpu's temperature raises above the HW the fan
+ * will come into play at the right speed. Also, there is a trigger timeout that will fire if the fan is down for more then a few
+ * minutes after the LW event. In this way we can cool down the RPI's temperature a little bit without reaching the HW or
+ * stressing us too much. Enjoy it!!
+ */
+
+/**
+ * Copyright 2019 Dino Ciuffetti - dam2000 at gmail dot com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+ * IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+  Warm restart: the controller state is checkpointed on tmpfs, periodically and on shutdown, and a restarted fanChat picks it up
+  if it comes from this boot and is fresh, instead of starting over with the fan off and a new trigger timeout cycle.
+*/
+// where the controller state is checkpointed
+#define CKPTFILE "/run/fanChat.checkpoint"
+// a checkpoint older than this (seconds) is not restored
+#define CKPTMAXAGESECS 120
+
+struct ckpt {
+	double LWT; // Last Low Watermark Time (CLOCK_BOOTTIME seconds)
+	int fan; // fan speed (%)
+	int pd; // fan speed chosen by the temperature policy
+	double boostend; // when the running boost ends (CLOCK_BOOTTIME seconds), 0 if none
+	unsigned int flags; // don't logspam flags, a bit each
+	unsigned long kicks; // kick-start pulses given to a stuck fan
+	double T; // filtered temperature
+	// dwell state (CLOCK_BOOTTIME seconds), so that a fan held off doesn't rest and spend its budget all over again
+	int dwslow; // running at the lowest speed after a slow start
+	double dwsince; // when the fan started or stopped
+	double dwchanged; // when its speed changed
+	double dwintegral; // temperature integral above LW since it stopped (C*s)
+};
+
+/**
+ * Set the checkpoint file path
+ */
+void ckpt_setfile(const char *path);
+
+/**
+ * Load the checkpoint into c. Return -1 if there is no fresh checkpoint from this boot, 0 on success
+ */
+int ckpt_load(struct ckpt *c);
+
+/**
+ * Atomically replace the checkpoint with c, written by the telemetry thread if it's running.
+ * Return -1 if the previous one is still being written (c is dropped) or 0 on success
+ */
+int ckpt_save(const struct ckpt *c);
@@ -41,29 +41,25 @@
 #include <time.h>
 #include "daemon.h"
 #include "cputemp.h"
+#include "load.h"
+#include "throttle.h"
+#include "status.h"
+#include "cgroup.h"
+#include "cpufreq.h"
+#include "pipeline.h"
+#include "telemetry.h"
+#include "seq.h"
+#include "health.h"
+#include "policy.h"
+#include "ckpt.h"
+#include "notify.h"
 #include "fan.h"
 #include "controller.h"
 
-// Low Watermark: at this temperature the fan will be off
-static const double LW=59.6;
-// High Watermark: at this temperature the fan will be on
-static const double HW=69.4;
-// Max fan speed will be reached when temperature rise above this one
-static const double max=79.4;
+// the temperature policy
+static struct policy pol;
 // Last Low Watermark Time: last time we reached Low Watermark
 static struct timespec LWT;
-// Trigger Timeout: after this time from Last Watermark the fan will be on (if temperature is above low watermark)
-static const struct timespec TTT = {.tv_sec=273, .tv_nsec=0 }; // 4min + 33 secs
-// how many seconds after Last Watermark and still no temperature down
-static const time_t max_seconds_after_LWT_and_no_temp_down = TTT.tv_sec * 2;
-
-/*
-  Fan speed steps. When the fan is ON its speed can be incremented by steps from 0 to 10, where step 0 is 42%, step 1 is 46%, and so on.
-  Step 0 will be on LW, Step 10 will be on max, btw the fan will be ALWAYS ON ONLY IF the temperature exceeds HW, eventually the Trigger timeout
-  will fire if temperature stands between LW and HW. Under LW the fan will be off.
-*/
-//                          STEPS:    0   1   2   3   4   5   6   7   8   9   10
-static const int fanstepsperc[11] = {42, 46, 52, 57, 61, 66, 72, 80, 88, 94, 100}; // %
 
 /**
  * subtract the 'struct timespec' values X and Y, storing the result in RESULT.
@@ -91,54 +87,6 @@ static int timespec_subtract(struct timespec *result, struct timespec *x, struct
 	return x->tv_sec < y->tv_sec;
 }
 
-/**
- * calculate fan speed (HW PWM driven) by the temperature. Return percentage chose.
- */
-static int calculateFanSpeedByTemp(double T) {
-	int i;
-	double tsbase, ts;
-	
-	tsbase=(max-LW)/10;
-	for(i=10; i>=0; i--) { // find the fan speed (from step 10 to 0)
-		ts=(LW+(tsbase*i));
-		if(T>ts) { // temperature exceed step i, returning proper fan speed
-			//syslog(LOG_INFO, "Temp: %2.1f C > %2.1f (step %i (0/10)), fan set at %i%%\n", T, ts, i, fanstepsperc[i]);
-			return fanstepsperc[i];
-		}
-	}
-	
-	//syslog(LOG_INFO, "Temp (%2.1f C) is under %2.1f, fan not needed at the moment\n", T, LW);
-	return 0;
-}
-
-/**
- * calculate usleep time depending on temperature. Higher temperatures require slower readings. Return useconds to sleep
- */
-static useconds_t calculateSleepDependingOnTemp(double T) {
-	useconds_t su=750000; // default is 0.75 seconds
-	
-	if(T>50.2) {
-		su=1000000;
-	}
-	if(T>62.5) {
-		su=1500000;
-	}
-	if(T>65.1) {
-		su=2000000;
-	}
-	if(T>70.6) {
-		su=3000000;
-	}
-	if(T>75.3) {
-		su=4000000;
-	}
-	if(T>77.6) {
-		su=5000000;
-	}
-	
-	return su;
-}
-
 /**
  * update process title. If p==-1 retain the last given perc value
  */
@@ -152,148 +100,369 @@ static void updateProcessTitle(double T, int p) {
 	if(p>0 && p<86) {
 		perc=p; // save the value
 		strcpy(ops, "cooling");
-		setproctitle("%2.1f C (LW: %2.1f C, HW: %2.1f C) - %s at %d%%", T, LW, HW, ops, p);
+		ttitle("%2.1f C (LW: %2.1f C, HW: %2.1f C) - %s at %d%%", T, pol.LW, pol.HW, ops, p);
 	}
 	if(p>85) {
 		perc=p; // save the value
 		strcpy(ops, "TURBO cooling");
-		setproctitle("%2.1f C (LW: %2.1f C, HW: %2.1f C) - %s at %d%%", T, LW, HW, ops, p);
+		ttitle("%2.1f C (LW: %2.1f C, HW: %2.1f C) - %s at %d%%", T, pol.LW, pol.HW, ops, p);
 	}
 	if(p==0) {
 		perc=p; // save the value
 		strcpy(ops, "idle");
-		setproctitle("%2.1f C (LW: %2.1f C, HW: %2.1f C) - %s", T, LW, HW, ops);
+		ttitle("%2.1f C (LW: %2.1f C, HW: %2.1f C) - %s", T, pol.LW, pol.HW, ops);
+	}
+}
+
+// current fan speed
+static int fanspeed=0;
+// kick-start pulses given to a stuck fan
+static unsigned long kicks=0;
+// from start to the first actuation (ms)
+static double startupms=0;
+// fan starts, stops and speed changes
+static unsigned long starts=0, stops=0, changes=0;
+// the don't logspam flags in a checkpoint
+#define CKPTFLAGS (tahdlsf | tbldlsf<<1 | ttrdlsf<<2 | ttndlsf<<4 | lffdlsf<<5)
+
+/**
+ * set fan speed to p% and show it in the process title
+ */
+static void setFanSpeed(double T, int p) {
+	if(p!=fanspeed) { // the PWM keeps its duty, write it only on changes
+		if(seq_name()==NULL) changes++; // the steps of a sequence (soft stop, kick-start...) are not decisions
+		if(fanspeed==0) starts++;
+		if(p==0) stops++;
+		fan_set(p);
+		fanspeed=p;
 	}
+	updateProcessTitle(T, p);
+}
+
+/**
+ * write the status file, ss are the sensor counters
+ */
+static void writeStatus(double T, struct cpuload *cl, const struct sensorstats *ss) {
+	status_begin();
+	status_add("temperature", "%.1f", T);
+	status_add("fan", "%d", fanspeed);
+	status_add("load", "%.0f", cl->sustained*100);
+	status_add("sequence", "%s", (seq_name()!=NULL) ? seq_name() : "none");
+	status_add("kicks", "%lu", kicks);
+	status_add("startup_ms", "%.1f", startupms);
+	status_add("fan_starts", "%lu", starts);
+	status_add("fan_stops", "%lu", stops);
+	status_add("fan_changes", "%lu", changes);
+	cputemp_status(ss);
+	throttle_status();
+	cpufreq_status();
+	cgroup_status();
+	health_status();
+	pipeline_status();
+	telemetry_status();
+	tstatus();
+}
+
+/**
+ * checkpoint the controller state: temperature T, fan speed chosen by the policy pd, the don't logspam flags and the dwell state dw.
+ * Return -1 if it's dropped or 0 on success
+ */
+static int saveCheckpoint(double T, int pd, unsigned int flags, const struct dwell *dw) {
+	struct ckpt c;
+	struct timespec now;
+	
+	clock_gettime(CLOCK_BOOTTIME, &now);
+	c.LWT=LWT.tv_sec+LWT.tv_nsec/1e9;
+	c.fan=fanspeed;
+	c.pd=pd;
+	c.boostend=(seq_prio()==SEQPRIO_BOOST) ? now.tv_sec+now.tv_nsec/1e9+seq_left()/1e3 : 0;
+	c.flags=flags;
+	c.kicks=kicks;
+	c.T=T;
+	c.dwslow=dw->slow;
+	c.dwsince=dw->since;
+	c.dwchanged=dw->changed;
+	c.dwintegral=dw->integral;
+	
+	return ckpt_save(&c);
 }
 
 /**
- * This is the controller, or main loop
+ * This is the controller, or main loop, driven by the temperature policy p starting from the temperature T0 read at startup.
+ * If ck is not NULL carry on from that checkpoint. Return 1 if the fan is left running for a restart, 0 if it was stopped
  */
-int controller(void) {
+int controller(const struct policy *p, double T0, const struct ckpt *ck) {
 	int ret;
+	int pd=0; // fan speed chosen by the temperature policy
+	int ff; // fan speed asked by the load feedforward
+	int fp; // fan speed to set in this round
+	int dp; // fan speed allowed by the dwell times
+	struct dwell dw; // fan on/off dwell state
+	int held=0; // the dwell held the fan off in the last round
+	int stalled; // temperature not going down for twice the trigger timeout: fan locked?
+	int stopping=0; // shutdown sequence initiated
 	double T;
-	useconds_t su;
-	struct timespec now, et, TT, tmp, tusr; // now: now, et: time elapsed from LWT, TT: Trigger Time, tmp: temporary counter, tusr: sigusr1 signal driven
+	struct cpuload cl;
+	struct sensorstats ss; // sensor counters, from where the sensor is read
+	useconds_t su, ssu; // ssu: sequence driven sleep
+	struct timespec now, et, TT, tmp, tst, TTT, lr; // now: now, et: time elapsed from LWT, TT: Trigger Time, tmp: temporary counter, tst: last status write, lr: last round
 	int tahdlsf=0; // don't logspam flag for temperature above high watermask messages
 	int tbldlsf=0; // don't logspam flag for temperature below low watermask messages
 	int ttrdlsf=0; // don't logspam flag for trigger timeout reached messages
 	int ttndlsf=1; // don't logspam flag for trigger timeout not reached messages
+	int lffdlsf=0; // don't logspam flag for load feedforward messages
+	int sfdlsf=0; // don't logspam flag for sensor failure messages
+	int dwdlsf=0; // don't logspam flag for dwell time messages
+	int sensorok; // the temperature can be trusted
+	int ready=0; // first actuation done
 	
-	clock_gettime(CLOCK_BOOTTIME, &tusr); // now
-	tusr.tv_sec-=1; // now - 1 second
-	
+	pol=*p;
+	T=T0; // the startup reading, in case the first one in the loop fails
+	// Trigger Timeout: after this time from Last Watermark the fan will be on (if temperature is above low watermark)
+	TTT.tv_sec=pol.TTT;
+	TTT.tv_nsec=0;
 	clock_gettime(CLOCK_BOOTTIME, &LWT); // resetting Last Low Watermark
-	syslog(LOG_NOTICE, "Low Watermark: %2.1f C, High Watermark: %2.1f C, Trigger Timeout: %lds+%ldns", LW, HW, TTT.tv_sec, TTT.tv_nsec);
+	tst=LWT;
+	if(ck!=NULL) { // warm restart: carry on from where the previous fanChat stopped
+		tmp=LWT;
+		LWT.tv_sec=(time_t)ck->LWT;
+		LWT.tv_nsec=(long)((ck->LWT-LWT.tv_sec)*1e9);
+		pd=ck->pd;
+		fanspeed=ck->fan;
+		kicks=ck->kicks;
+		tahdlsf=ck->flags&1;
+		tbldlsf=(ck->flags>>1)&1;
+		ttrdlsf=(ck->flags>>2)&3;
+		ttndlsf=(ck->flags>>4)&1;
+		lffdlsf=(ck->flags>>5)&1;
+		if(ck->boostend>tmp.tv_sec+1) { // the boost was still running
+			seq_boost(fanspeed, (unsigned int)(ck->boostend-tmp.tv_sec));
+		}
+		tlog(LOG_NOTICE, "Warm restart: fan at %d%%, Last Low Watermark %ld seconds ago", fanspeed, (long)(tmp.tv_sec-LWT.tv_sec));
+	}
+	memset(&dw, 0, sizeof(dw));
+	dw.on=(fanspeed>0);
+	dw.p=fanspeed;
+	if(ck!=NULL) { // carry on resting, or running, from where it was
+		dw.slow=ck->dwslow;
+		dw.since=ck->dwsince;
+		dw.changed=ck->dwchanged;
+		dw.integral=ck->dwintegral;
+	}
+	lr=LWT;
+	tst.tv_sec-=STATUSINTERVALSECS; // write the status on the first round
+	tlog(LOG_NOTICE, "Low Watermark: %2.1f C, High Watermark: %2.1f C, Trigger Timeout: %lds+%ldns", pol.LW, pol.HW, TTT.tv_sec, TTT.tv_nsec);
 	
 	while(1) {
 		clock_gettime(CLOCK_BOOTTIME, &now);
+		if(held) { // the fan was off on purpose since the last round, that's no time it failed to cool: move LWT forward
+			tmp=lr;
+			timespec_subtract(&et, &now, &tmp);
+			LWT.tv_sec+=et.tv_sec;
+			LWT.tv_nsec+=et.tv_nsec;
+			if(LWT.tv_nsec>=1000000000) {
+				LWT.tv_sec++;
+				LWT.tv_nsec-=1000000000;
+			}
+		}
+		lr=now;
+		held=0;
 		
-		// 1- get the current temperature
-		ret=getcputemp(&T);
-		if(ret<0) {
-			syslog(LOG_ERR, "ERROR: Cannot read CPU temperature! Assuming temperature is not so high.");
-			T=58;
+		// 1- get the current temperature and CPU load
+		if(pipeline_running()) { // from the sensor thread
+			sensorok=pipeline_get(&T, &cl, &ss);
+		} else {
+			sensorok=(getcputemp(&T)==0);
+			cputemp_stats(&ss);
+			if(load_sample(&cl)<0) {
+				cl.sustained=0;
+			}
+		}
+		cputemp_report(&ss);
+		load_report();
+		if(!sensorok) {
+			if(sfdlsf==0) {
+				tlog(LOG_ERR, "ERROR: Cannot read CPU temperature! Failing safe, fan at full speed until the sensor recovers.");
+				sfdlsf=1;
+			}
+		} else if(sfdlsf==1) {
+			tlog(LOG_NOTICE, "CPU temperature sensor recovered. Temp %2.1f C", T);
+			sfdlsf=0;
 		} /* else {
 			syslog(LOG_INFO, "CPU temperature is %2.1f C.", T);
 		} */
 		
-		if(timespec_subtract(&tmp,&tusr,&now)==0) { // still let the fan at full speed...
-			//syslog(LOG_NOTICE, "Temp %2.1f C, fan at full speed for a while", T);
-			updateProcessTitle(T, 100);
+		if(!sensorok) { // we don't know the temperature, fan at full speed
+			fp=100;
 			su=1000000; // sleep for a second
 		} else {
 			// 2- calculate the right fan speed in case we need to put the fan ON
-			ret=calculateFanSpeedByTemp(T);
+			ret=policy_speedbytemp(&pol, T);
 			
 			// 3- is the current temperature above the HW?
-			if(T>=HW) {
+			if(T>=pol.HW) {
 				if(tahdlsf==0) {
-					syslog(LOG_NOTICE, "Temp %2.1f C above HW (%2.1f C), set fan speed to %d%%", T, HW, ret);
+					tlog(LOG_NOTICE, "Temp %2.1f C above HW (%2.1f C), set fan speed to %d%%", T, pol.HW, ret);
 					tahdlsf=1;
 					tbldlsf=0;
 					ttrdlsf=1;
 				}
-				fan_set(ret);
-				updateProcessTitle(T, ret);
+				pd=ret;
 			}
 			
 			// 4- is the current temperature under the LW?
-			if(T<=LW) {
+			if(T<=pol.LW) {
 				if(tbldlsf==0) {
-					syslog(LOG_NOTICE, "Temp %2.1f C below LW (%2.1f C), set fan speed to %d%%", T, LW, ret);
+					tlog(LOG_NOTICE, "Temp %2.1f C below LW (%2.1f C), set fan speed to %d%%", T, pol.LW, ret);
 					tbldlsf=1;
 					tahdlsf=0;
 					ttrdlsf=0;
 				}
 				clock_gettime(CLOCK_BOOTTIME, &LWT);
-				fan_set(ret);
-				updateProcessTitle(T, ret);
+				pd=ret;
 			}
 			
 			// 5- is LWT happened more than TT ago?
 			tmp=LWT;
 			timespec_subtract(&et, &now, &tmp); // time elapsed from LWT
-			su=calculateSleepDependingOnTemp(T);
+			su=policy_sleep(&pol, T);
+			stalled=(et.tv_sec > TTT.tv_sec * 2); // how many seconds after Last Watermark and still no temperature down
 			tmp=TTT;
 			if(timespec_subtract(&TT,&tmp,&et)==1) { // we've reached the TTT
 				if(ttrdlsf==0) {
-					syslog(LOG_NOTICE, "Trigger Timeout reached (too much time after LWT). Temp %2.1f C, set fan speed to %d%%", T, ret);
+					tlog(LOG_NOTICE, "Trigger Timeout reached (too much time after LWT). Temp %2.1f C, set fan speed to %d%%", T, ret);
 					ttrdlsf=1;
 					tahdlsf=0;
 					tbldlsf=0;
 				}
-				if(et.tv_sec > max_seconds_after_LWT_and_no_temp_down) {
+				if(stalled) {
 					if(ttrdlsf==1) {
-						syslog(LOG_WARNING, "Too much time after LWT and temperature is not going down! Fan locked or load is high? Temp %2.1f C", T);
-						syslog(LOG_WARNING, "Trying to unlock fan, just in case, giving it a strong 0-100 pulse");
+						tlog(LOG_WARNING, "Too much time after LWT and temperature is not going down! Fan locked or load is high? Temp %2.1f C", T);
+						tlog(LOG_WARNING, "Trying to unlock fan, just in case, giving it a strong 0-100 pulse");
 						ttrdlsf=2;
-						
-						ret=0;
-						fan_set(ret);
-						updateProcessTitle(T, ret);
-						usleep(830000);
+						seq_kick(fanspeed);
+						kicks++;
 					}
 					ret=100;
-					fan_set(ret);
-					updateProcessTitle(T, ret);
-					usleep(1000000);
-				} else {
-					fan_set(ret);
-					updateProcessTitle(T, ret);
 				}
+				pd=ret;
 			} else {
 				if(ttndlsf==0) {
-					syslog(LOG_INFO, "Trigger Timeout NOT again reached. Temp %2.1f C", T);
+					tlog(LOG_INFO, "Trigger Timeout NOT again reached. Temp %2.1f C", T);
 					ttndlsf=1;
 				}
 				// TT is the trigger time that we need to sleep before next round
 				if((TT.tv_sec==0) && ((TT.tv_nsec*1000) < su)) { // we need to wake up earlier
-					syslog(LOG_NOTICE, "We would wake up earlier: %ld usecs instead of %d usecs", (TT.tv_nsec*1000), su);
+					tlog(LOG_NOTICE, "We would wake up earlier: %ld usecs instead of %d usecs", (TT.tv_nsec*1000), su);
 					su=TT.tv_nsec*1000;
 					ttrdlsf=0;
 					ttndlsf=0;
 					tahdlsf=0;
 					tbldlsf=0;
 				}
-				updateProcessTitle(T, -1);
 			}
+			
+			// 6- sustained load asks for more cooling than temperature does? Spin up the fan in advance
+			ff=policy_speedbyload(&pol, T, cl.sustained);
+			if(ff>pd) {
+				if(lffdlsf==0) {
+					tlog(LOG_NOTICE, "Sustained CPU load %2.0f%% (PSI %2.0f%%). Temp %2.1f C, set fan speed to %d%% in advance", cl.sustained*100, cl.psi*100, T, ff);
+					lffdlsf=1;
+				}
+				fp=ff;
+			} else {
+				if(lffdlsf==1) {
+					tlog(LOG_NOTICE, "CPU load is gone. Temp %2.1f C, set fan speed to %d%%", T, pd);
+					lffdlsf=0;
+				}
+				fp=pd;
+			}
+			
+			// 7- respect the minimum on/off times: fewer and longer fan runs. Above HW, load feedforward and a stuck fan can't wait
+			dp=policy_dwell(&pol, &dw, T, now.tv_sec+now.tv_nsec/1e9, fp, T>=pol.HW || ff>pd || stalled);
+			held=(fp>0 && dp==0);
+			if(dp!=fp) {
+				if(dwdlsf==0) {
+					tlog(LOG_INFO, "Dwell time: fan at %d%% instead of %d%%. Temp %2.1f C", dp, fp, T);
+					dwdlsf=1;
+				}
+				fp=dp;
+			} else {
+				dwdlsf=0;
+			}
+		}
+		
+		// 8- a running sequence (kick-start, boost, soft stop...) owns the fan, unless we are failing safe
+		if(seq_run(&ret, &ssu)) {
+			if(sensorok || stopping) fp=ret;
+			if(ssu<su) su=ssu;
+		} else if(stopping) { // soft stop done
+			fp=0;
+		}
+		setFanSpeed(T, fp);
+		policy_dwellset(&dw, now.tv_sec+now.tv_nsec/1e9, fanspeed); // failing safe and sequences override the dwell
+		if(fanspeed>0) held=0;
+		if(!ready) { // how long the fan was left alone at startup
+			clock_gettime(CLOCK_BOOTTIME, &tmp);
+			startupms=(tmp.tv_sec-tstart.tv_sec)*1e3+(tmp.tv_nsec-tstart.tv_nsec)/1e6;
+			tlog(LOG_NOTICE, "First fan actuation %.1f ms after start", startupms);
+			notify("READY=1");
+			ready=1;
+		}
+		
+		// 9- learn how well the fan cools, sequences don't tell much about it
+		if(sensorok && seq_name()==NULL) {
+			health_sample(T, fanspeed, cl.sustained);
+		}
+		
+		// 10- thermal headroom running out despite the fan? Slow down batch workloads, then lower the CPU frequency ceiling, instead
+		// of waiting for the firmware to throttle all
+		if(sensorok) {
+			cpufreq_control(p, T, fanspeed, throttle_curfreq());
+			cgroup_control(T);
+		}
+		
+		// 11- is the SoC throttling? Tie new events to this temperature and fan speed
+		ret=throttle_sample(T, fanspeed);
+		if(ret>0 || now.tv_sec-tst.tv_sec>=STATUSINTERVALSECS) {
+			writeStatus(T, &cl, &ss);
+			if(sensorok && !stopping) saveCheckpoint(T, pd, CKPTFLAGS, &dw);
+			tst=now;
 		}
+		
 		if(e_flag) { // signal trapped, we should exit
-			syslog(LOG_NOTICE, "Termination signal trapped, shutdown sequence initiated");
-			return 0;
+			if(!stopping) {
+				tlog(LOG_NOTICE, "Termination signal trapped, shutdown sequence initiated");
+				notify("STOPPING=1");
+				if(sensorok && saveCheckpoint(T, pd, CKPTFLAGS, &dw)==0) { // a restart carries on from here, don't stop the fan meanwhile
+					tlog(LOG_NOTICE, "Fan left at %d%% for a restart", fanspeed);
+					writeStatus(T, &cl, &ss);
+					return 1;
+				}
+				stopping=1;
+				seq_softstop(fanspeed, SOFTSTOPMSECS);
+				su=0; // start it now
+			} else if(seq_name()==NULL) {
+				writeStatus(T, &cl, &ss);
+				return 0;
+			}
 		}
 		if(fanonforawhile) { // signal trapped. Fan at maximum speed for a while
-			syslog(LOG_NOTICE, "Signal trapped, fan at maximum speed for a while (%i) seconds", FANONFORAWHILESECS);
+			tlog(LOG_NOTICE, "Signal trapped, fan at maximum speed for a while (%i) seconds", FANONFORAWHILESECS);
 			fanonforawhile=0;
-			updateProcessTitle(T, 100);
-			fan_set(100);
-			clock_gettime(CLOCK_BOOTTIME, &tusr); // now
-			// after this time we should run normally
-			tusr.tv_sec+=FANONFORAWHILESECS;
+			if(seq_boost(fanspeed, FANONFORAWHILESECS)==0) {
+				su=0; // start it now
+			}
 		}
 		
 		//syslog(LOG_INFO, "Sleeping for %u useconds", su);
-		usleep(su);
+		su=notify_watchdog(su); // we are alive, and we wake up in time for the next ping
+		if(pipeline_running()) {
+			pipeline_wait(su); // a new sample wakes us up earlier
+		} else {
+			su=cputemp_schedule(su); // wake up just after the next sensor update
+			load_wait(su); // CPU pressure wakes us up earlier
+		}
 	}
 	
 	return 0;
@@ -37,10 +37,18 @@
  * IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+struct policy;
+struct ckpt;
+
 // how many seconds the fan should run at full speed when sigusr1 has received
 #define FANONFORAWHILESECS 30
+// how many milliseconds the fan takes to stop on shutdown
+#define SOFTSTOPMSECS 2000
+// how many seconds between status file updates
+#define STATUSINTERVALSECS 10
 
 /**
- * This is the controller, or main loop
+ * This is the controller, or main loop, driven by the temperature policy p starting from the temperature T0 read at startup.
+ * If ck is not NULL carry on from that checkpoint. Return 1 if the fan is left running for a restart, 0 if it was stopped
  */
-int controller(void);
+int controller(const struct policy *p, double T0, const struct ckpt *ck);
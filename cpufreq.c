@@ -0,0 +1,259 @@
+/**
+ * Author: Dino Ciuffetti - dam2000 at gmail dot com
+ * Home: https://github.com/dam2k/fanChat
+ * Date: 2019-10-27
+ * Whatis: Melopero's FanHat Raspberry Pi FAN controller daemon rethinked from scratch and written in C
+ * Work with: Melopero FAN HAT for Raspberry Pi 4
+ *   https://www.melopero.com/shop/melopero-engineering/melopero-fan-hat-for-raspberry-pi-4/
+ * Requires: PiGpio library: http://abyz.me.uk/rpi/pigpio/ - apt update && apt install libpigpio-dev
+ * Replaces: official fan driver written in python: https://www.melopero.com/fan-hat/
+ * License: MIT License - https://opensource.org/licenses/MIT
+ *
+ * Notes:
+ * The Melopero FAN HAT for Raspberry Pi 4 is a cool (freddo!! :-)) fan driver for Raspberry Pi 4. It works using GPIO PIN 18 that
+ * has hardware driven PWM capabilities. This way they can handle fan speed changing the PIN's duty cycle.
+ * We continuously read the CPU temperature thanks to the /sys/class/thermal/thermal_zone0/temp file and we take care of cooling
+ * the CPU by setting up the right fan speed modulating the pin's PWM attached to the fan hat.
+ * Since I really hate when the fan is always on at low speed, I thinked of using a high and low watermarks.
+ * If the cpu's temperature is below the LW the fan will be shut down, and when the cpu's temperature raises above the HW the fan
+ * will come into play at the right speed. Also, there is a trigger timeout that will fire if the fan is down for more then a few
+ * minutes after the LW event. In this way we can cool down the RPI's temperature a little bit without reaching the HW or
+ * stressing us too much. Enjoy it!!
+ */
+
+/**
+ * Copyright 2019 Dino Ciuffetti - dam2000 at gmail dot com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+ * IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "common.h"
+#include <limits.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "sysfs.h"
+#include "status.h"
+#include "telemetry.h"
+#include "throttle.h"
+#include "policy.h"
+#include "cpufreq.h"
+
+// the cpufreq policy of all the Pi cores
+#define CPUFREQDIR "/sys/devices/system/cpu/cpufreq/policy0"
+// the ceiling is raised again this much below the temperature where the policy's fan curve runs out (C)
+#define CFHYSTERESIS 3.0
+// the ceiling changes by this step (kHz)...
+#define CFSTEPKHZ 100000
+// ...not more often than this (seconds), so the temperature can react
+#define CFSTEPSECS 2
+
+/*
+  The ceiling found at startup is the administrator's (an under-clock is kept) and is written back when the temperature recovers.
+  While it is lowered, that original ceiling is recorded in the state directory: a fanChat killed meanwhile leaves the record, and
+  the next one restores the ceiling from it.
+*/
+static int maxfreqfd=-1;
+static char cfstatefile[PATH_MAX]; // the lowered ceiling record
+static unsigned long origmax; // scaling_max_freq as the administrator set it, the unlimited ceiling (kHz)
+static unsigned long minfreq; // cpuinfo_min_freq, the lowest ceiling (kHz)
+static unsigned long ceiling; // current ceiling (kHz)
+static struct timespec tstep; // last step
+static struct timespec tlast; // last control round
+static unsigned long events=0; // how many times we started lowering the ceiling
+static double secs=0; // how long the ceiling was lowered
+static double khzsecs=0; // work done while the ceiling was lowered (kHz*s)
+static atomic_int lowered=ATOMIC_VAR_INIT(0); // the ceiling is lowered: the record must exist
+
+// read an unsigned number (kHz) from the file name in CPUFREQDIR, 0 on errors
+static unsigned long cpufreq_readfile(const char *name) {
+	char p[128], b[32];
+	unsigned long long v=0;
+	int fd;
+	
+	snprintf(p, sizeof(p), "%s/%s", CPUFREQDIR, name);
+	fd=sysfs_open(p, O_RDONLY);
+	if(fd<0) return 0;
+	if(sysfs_read(fd, b, sizeof(b))<=0 || sysfs_parseull(b, &v)==NULL) v=0;
+	close(fd);
+	
+	return (unsigned long)v;
+}
+
+// write or remove the lowered ceiling record, on the telemetry thread if it's running
+static void cpufreq_flush(void) {
+	char tmp[PATH_MAX+4], b[32];
+	int fd;
+	ssize_t r;
+	
+	if(!atomic_load(&lowered)) {
+		if(unlink(cfstatefile)<0 && errno!=ENOENT) tlog(LOG_ERR, "Cannot remove %s: %s", cfstatefile, strerror(errno));
+		return;
+	}
+	snprintf(b, sizeof(b), "%lu\n", origmax);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", cfstatefile);
+	fd=open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd<0) {
+		tlog(LOG_ERR, "Cannot write %s: %s", tmp, strerror(errno));
+		return;
+	}
+	r=write(fd, b, strlen(b));
+	close(fd);
+	if(r!=(ssize_t)strlen(b) || rename(tmp, cfstatefile)<0) {
+		tlog(LOG_ERR, "Cannot write %s: %s", cfstatefile, strerror(errno));
+		unlink(tmp);
+	}
+}
+
+// record that the ceiling is lowered (l=1) or not (l=0)
+static void cpufreq_record(int l) {
+	atomic_store(&lowered, l);
+	if(tcall(cpufreq_flush)<0) cpufreq_flush(); // the queue is full: a lost record would leave the CPU slowed down for good
+}
+
+// write the CPU frequency ceiling f (kHz)
+static int cpufreq_setceiling(unsigned long f) {
+	char b[32];
+	
+	snprintf(b, sizeof(b), "%lu\n", f);
+	if(sysfs_write(maxfreqfd, b)<0) {
+		tlog(LOG_ERR, "Cannot set the CPU frequency ceiling to %lu MHz: %s", f/1000, strerror(errno));
+		return -1;
+	}
+	ceiling=f;
+	
+	return 0;
+}
+
+/**
+ * Manage the cpufreq policy frequency ceiling (scaling_max_freq) as the next actuator after the fan, keeping the record of a
+ * lowered ceiling in statefile. Return -1 on errors or 0 on success
+ */
+int cpufreq_setup(const char *statefile) {
+	char b[32];
+	unsigned long long v, o;
+	int fd;
+	ssize_t n;
+	
+	snprintf(cfstatefile, sizeof(cfstatefile), "%s", statefile);
+	maxfreqfd=sysfs_open(CPUFREQDIR "/scaling_max_freq", O_RDWR);
+	if(maxfreqfd<0) {
+		fprintf(stderr, "Cannot open %s/scaling_max_freq: %s\n", CPUFREQDIR, strerror(errno));
+		return -1;
+	}
+	minfreq=cpufreq_readfile("cpuinfo_min_freq");
+	if(sysfs_read(maxfreqfd, b, sizeof(b))<=0 || sysfs_parseull(b, &v)==NULL || minfreq==0) {
+		fprintf(stderr, "Cannot parse %s/scaling_max_freq and cpuinfo_min_freq\n", CPUFREQDIR);
+		goto err;
+	}
+	origmax=ceiling=(unsigned long)v;
+	// a ceiling left lowered by a fanChat killed meanwhile: its record has the administrator's one
+	fd=open(cfstatefile, O_RDONLY);
+	if(fd>=0) {
+		n=read(fd, b, sizeof(b)-1);
+		close(fd);
+		b[(n>0) ? n : 0]='\0';
+		if(sysfs_parseull(b, &o)==NULL || o<minfreq) {
+			fprintf(stderr, "Ignoring invalid CPU frequency ceiling record %s\n", cfstatefile);
+		} else {
+			origmax=(unsigned long)o;
+			fprintf(stderr, "CPU frequency ceiling was left lowered (%lu MHz), restoring %lu MHz\n", ceiling/1000, origmax/1000);
+			if(cpufreq_setceiling(origmax)<0) goto err;
+		}
+		unlink(cfstatefile);
+	}
+	if(origmax<=minfreq) {
+		fprintf(stderr, "No room to lower the CPU frequency ceiling (%lu MHz)\n", origmax/1000);
+		goto err;
+	}
+	clock_gettime(CLOCK_BOOTTIME, &tlast);
+	tstep=tlast;
+	
+	return 0;
+	
+err:
+	close(maxfreqfd);
+	maxfreqfd=-1;
+	return -1;
+}
+
+/**
+ * Lower the CPU frequency ceiling when thermal headroom is exhausted: the fan at p% is at the top step of the policy pol and the
+ * temperature T is still where its curve runs out. Raise it as the temperature recovers. curfreq is the CPU frequency (kHz), 0 if
+ * unknown
+ */
+void cpufreq_control(const struct policy *pol, double T, int p, unsigned long curfreq) {
+	struct timespec now;
+	unsigned long f=ceiling;
+	double dt;
+	
+	if(maxfreqfd<0) return;
+	clock_gettime(CLOCK_BOOTTIME, &now);
+	dt=(now.tv_sec-tlast.tv_sec)+(now.tv_nsec-tlast.tv_nsec)/1e9;
+	tlast=now;
+	if(ceiling<origmax) { // how much work we still got
+		secs+=dt;
+		khzsecs+=((curfreq>0 && curfreq<ceiling) ? curfreq : ceiling)*dt;
+	}
+	if(now.tv_sec-tstep.tv_sec<CFSTEPSECS) return;
+	
+	if(p>=pol->steps[POLICYSTEPS-1] && T>=pol->max && ceiling>minfreq) {
+		f=(ceiling>minfreq+CFSTEPKHZ) ? ceiling-CFSTEPKHZ : minfreq;
+		if(ceiling==origmax) {
+			events++;
+			tlog(LOG_WARNING, "Thermal headroom exhausted, fan at %d%%. Temp %2.1f C, lowering the CPU frequency ceiling to %lu MHz", p, T, f/1000);
+			cpufreq_record(1); // before lowering it, so a kill can't leave it lowered without
+		}
+	} else if(T<=pol->max-CFHYSTERESIS && ceiling<origmax) {
+		f=(ceiling+CFSTEPKHZ<origmax) ? ceiling+CFSTEPKHZ : origmax;
+		if(f==origmax) {
+			tlog(LOG_NOTICE, "Temp %2.1f C, CPU frequency ceiling restored. Limited for %.0fs so far at %.0f%% of full speed",
+				T, secs, khzsecs*100/(origmax*secs));
+		}
+	}
+	if(f!=ceiling && cpufreq_setceiling(f)==0) {
+		tstep=now;
+		if(f==origmax) cpufreq_record(0);
+	}
+}
+
+/**
+ * Append frequency ceiling counters and the throughput estimates to the status report
+ */
+void cpufreq_status(void) {
+	unsigned long tf;
+	
+	if(maxfreqfd<0) return;
+	status_add("cpufreq_ceiling_mhz", "%lu", ceiling/1000);
+	status_add("cpufreq_events", "%lu", events);
+	status_add("cpufreq_seconds", "%.1f", secs);
+	if(secs>0) {
+		// sustained throughput while limited, as a share of full speed and as a gain over the firmware throttled frequency
+		status_add("cpufreq_throughput", "%.0f", khzsecs*100/(origmax*secs));
+		tf=throttle_throttledfreq();
+		if(tf>0) {
+			status_add("cpufreq_benefit", "%.0f", (khzsecs/secs/tf-1)*100);
+		} else {
+			status_add("cpufreq_benefit", "unknown"); // no firmware throttling seen yet to compare with
+		}
+	}
+}
+
+/**
+ * Restore the administrator's CPU frequency ceiling and close file descriptors
+ */
+void cpufreq_restore(void) {
+	if(maxfreqfd<0) return;
+	if(ceiling<origmax && cpufreq_setceiling(origmax)==0) cpufreq_record(0);
+	close(maxfreqfd);
+	maxfreqfd=-1;
+}
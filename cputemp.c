@@ -38,61 +38,465 @@
  */
 
 #include "common.h"
+#include <stdarg.h>
+#include <time.h>
+#include <math.h>
+#include "sysfs.h"
+#include "status.h"
+#include "telemetry.h"
 #include "cputemp.h"
 
 #define CPUTEMPSYSFILE "/sys/class/thermal/thermal_zone0/temp"
 
+// a reading farther than this from the filtered temperature is an outlier...
+#define OUTLIERDELTA 10.0
+// ...unless these many consecutive readings agree on it
+#define OUTLIERCONFIRM 2
+// readings out of this range are garbage
+#define SENSORMIN -40.0
+#define SENSORMAX 125.0
+// reopen backoff after errors (seconds)
+#define REOPENMINSECS 1
+#define REOPENMAXSECS 32
+// max median filter window
+#define MEDIANMAX 7
+
+/*
+  The thermal driver may update the zone temperature on its own polling interval: reading more often returns duplicates, reading
+  out of phase adds latency. The update period and phase are learnt timing value changes while reading fast, then reads are
+  scheduled just after each expected update. An early/late gate keeps the phase locked: every fresh read moves the next ones
+  CADENCENUDGEUS earlier, every duplicate moves them CADENCEMARGINUS later.
+  The sensor is quantised (about 0.5 C on a Pi 4): at a steady temperature most updates don't change the value, so a duplicate
+  alone doesn't tell a missed update, and intervals between changes are often multiples of the period. The phase is taken as
+  lost only if the value keeps changing away from the expected updates, relearning backs off exponentially, and a sensor that
+  is perfectly steady while learning can't be learnt at all (the controller then reads whenever it wants).
+*/
+#define CADENCE_UNKNOWN 0 // not learnt yet or given up: read whenever the controller wants
+#define CADENCE_LEARNING 1 // reading fast to time value changes
+#define CADENCE_LOCKED 2 // reads are scheduled just after each expected update
+#define CADENCE_CONTINUOUS 3 // the value is fresh at every read, nothing to align to
+// read this often while learning (useconds)
+#define CADENCEPROBEUS 50000
+// how many value changes to time while learning
+#define CADENCECHANGES 7
+// give up learning after these seconds
+#define CADENCELEARNSECS 10
+// learn again after these seconds...
+#define CADENCERELEARNSECS 600
+// ...doubling up to these after failures or a lost phase
+#define CADENCEMAXRELEARNSECS 21600
+// read this long after the expected update (useconds)
+#define CADENCEMARGINUS 20000
+// early/late gate step (useconds)
+#define CADENCENUDGEUS 1000
+// learn again after these consecutive duplicates at aligned reads...
+#define CADENCEMAXDUPS 3
+// ...if the value changed at least these times away from the expected updates meanwhile
+#define CADENCEMINMISSES 3
+
+#define FILTER_NONE 0
+#define FILTER_MEDIAN 1
+#define FILTER_EWMA 2
+
 // cpu file descriptor
 static int cpufd=-1;
+// don't open the file again before this time
+static struct timespec reopent;
+static time_t backoff=REOPENMINSECS;
 
-// return cpu file descriptor or -1 on errors
-static int cputemp_fd(void) {
-	if(cpufd!=-1) return cpufd; //return previously opened fd
-	cpufd=open(CPUTEMPSYSFILE, O_RDONLY);
-	/*
-	if(cpufd<0) {
-		fprintf(stderr, "Error opening cputemp sysfile %s: %s\n", CPUTEMPSYSFILE, strerror(errno));
+// noise filter
+static int ftype=FILTER_MEDIAN;
+static int mlen=3; // median window
+static double ealpha=0.3; // EWMA smoothing factor
+static double mwin[MEDIANMAX]; // median window ring
+static int mpos=0, mfill=0;
+static double Tf; // filtered temperature
+static int tfvalid=0;
+
+// outlier rejection
+static int outliers=0; // consecutive outliers
+static int outlierside=0; // 1: above, -1: below the filtered temperature
+
+// health
+static int health=SENSOR_FAILED;
+static struct timespec goodt; // last good reading
+static unsigned long reads=0, errors=0, rejected=0, reopens=0;
+static int sedlsf=0; // don't logspam flag for sensor errors
+
+// update cadence (times are CLOCK_BOOTTIME seconds)
+static int cadence=CADENCE_UNKNOWN;
+static double cadencet=0; // when learning started, or when to learn again
+static long lastm; // last raw reading (millidegrees)
+static int lastmvalid=0;
+static double lastread; // last raw reading time
+static double chg[CADENCECHANGES]; // value change times while learning
+static int nchg;
+static double period; // update period
+static double upd; // time of an expected update
+static int dupsrow=0; // consecutive duplicates at aligned reads
+static int misses=0; // value changes away from the expected updates since the last fresh aligned read
+static double relearnsecs=CADENCERELEARNSECS; // next relearn after a failure or a lost phase
+static unsigned long dups=0; // reads returning the previous value
+static double stalesum=0; // sum of the value ages at reads, while locked
+static unsigned long stalen=0;
+
+// log messages, handed over with the counters snapshot: the sensor may be read on a thread where slow outputs don't belong
+static unsigned long notes=0;
+static int noteprio;
+static char note[SENSORNOTELEN];
+
+static void cputemp_note(int prio, const char *fmt, ...) {
+	va_list ap;
+	
+	va_start(ap, fmt);
+	vsnprintf(note, sizeof(note), fmt, ap);
+	va_end(ap);
+	noteprio=prio;
+	notes++;
+}
+
+/**
+ * Setup the noise filter: "none", "median:N" (N odd, 3 to 7) or "ewma:A" (0 < A <= 1). Return -1 on invalid filters
+ */
+int cputemp_setfilter(const char *spec) {
+	char *e;
+	long n;
+	double a;
+	
+	if(strcmp(spec, "none")==0) {
+		ftype=FILTER_NONE;
+	} else if(strncmp(spec, "median:", 7)==0) {
+		n=strtol(spec+7, &e, 10);
+		if(*e!='\0' || n<3 || n>MEDIANMAX || n%2==0) return -1;
+		ftype=FILTER_MEDIAN;
+		mlen=n;
+	} else if(strncmp(spec, "ewma:", 5)==0) {
+		a=strtod(spec+5, &e);
+		if(*e!='\0' || a<=0 || a>1) return -1;
+		ftype=FILTER_EWMA;
+		ealpha=a;
+	} else {
 		return -1;
 	}
-	*/
+	mpos=mfill=0;
+	tfvalid=0;
+	
+	return 0;
+}
+
+// return cpu file descriptor or -1 on errors, reopening it with backoff
+static int cputemp_fd(struct timespec *now) {
+	if(cpufd!=-1) return cpufd; //return previously opened fd
+	if(now->tv_sec<reopent.tv_sec) return -1; // still backing off
+	cpufd=sysfs_open(CPUTEMPSYSFILE, O_RDONLY);
+	if(cpufd>=0 && reads>0) reopens++;
 	
 	return cpufd;
 }
 
+// an error happened: close the fd and don't reopen it for a while
+static void cputemp_error(struct timespec *now, const char *what) {
+	errors++;
+	if(sedlsf==0) {
+		cputemp_note(LOG_ERR, "Error %s cputemp sysfile %s: %s", what, CPUTEMPSYSFILE, strerror(errno));
+		sedlsf=1;
+	}
+	if(cpufd!=-1) close(cpufd);
+	cpufd=-1;
+	reopent.tv_sec=now->tv_sec+backoff;
+	backoff*=2;
+	if(backoff>REOPENMAXSECS) backoff=REOPENMAXSECS;
+}
+
+// feed the noise filter with t, return the filtered temperature
+static double cputemp_filter(double t) {
+	double w[MEDIANMAX], x;
+	int i, j;
+	
+	switch(ftype) {
+	case FILTER_MEDIAN:
+		mwin[mpos]=t;
+		mpos=(mpos+1)%mlen;
+		if(mfill<mlen) mfill++;
+		// insertion sort of a copy of the (small) window
+		for(i=0; i<mfill; i++) {
+			x=mwin[i];
+			for(j=i; j>0 && w[j-1]>x; j--) w[j]=w[j-1];
+			w[j]=x;
+		}
+		return w[mfill/2];
+	case FILTER_EWMA:
+		if(!tfvalid) return t;
+		return Tf+ealpha*(t-Tf);
+	default:
+		return t;
+	}
+}
+
+static double ts2d(struct timespec *t) {
+	return t->tv_sec+t->tv_nsec/1e9;
+}
+
+static void cadence_learn(double t) {
+	cadence=CADENCE_LEARNING;
+	cadencet=t;
+	nchg=0;
+	dupsrow=0;
+	misses=0;
+}
+
+// give up the cadence until t plus the relearn backoff, doubling it
+static void cadence_giveup(double t) {
+	cadence=CADENCE_UNKNOWN;
+	cadencet=t+relearnsecs;
+	relearnsecs=(relearnsecs*2<CADENCEMAXRELEARNSECS) ? relearnsecs*2 : CADENCEMAXRELEARNSECS;
+}
+
+// time the raw reading m read at t, learning and tracking the sensor update cadence
+static void cadence_update(long m, double t) {
+	double x, sum, off;
+	int dup, i, n;
+	
+	dup=(lastmvalid && m==lastm);
+	if(dup) dups++;
+	
+	switch(cadence) {
+	case CADENCE_LEARNING:
+		if(lastmvalid && !dup) { // the update happened between the last read and this one
+			chg[nchg++]=(t+lastread)/2;
+		}
+		if(nchg==CADENCECHANGES) {
+			// updates that don't change the value make some intervals multiples of the period: take the shortest one as a first
+			// guess, then average all the intervals over how many periods each one spans
+			x=chg[1]-chg[0];
+			for(i=1; i<CADENCECHANGES-1; i++) {
+				if(chg[i+1]-chg[i]<x) x=chg[i+1]-chg[i];
+			}
+			sum=0;
+			n=0;
+			for(i=0; i<CADENCECHANGES-1; i++) {
+				sum+=chg[i+1]-chg[i];
+				n+=(int)floor((chg[i+1]-chg[i])/x+0.5);
+			}
+			period=sum/n;
+			cadencet=t+CADENCERELEARNSECS;
+			if(period<3*CADENCEPROBEUS/1e6) {
+				cadence=CADENCE_CONTINUOUS;
+				cputemp_note(LOG_NOTICE, "CPU temperature sensor is fresh at every read, no update cadence to follow");
+			} else {
+				cadence=CADENCE_LOCKED;
+				upd=chg[CADENCECHANGES-1];
+				cputemp_note(LOG_NOTICE, "CPU temperature sensor updates every %.0f ms, reads locked to its phase", period*1000);
+			}
+		} else if(t-cadencet>CADENCELEARNSECS) {
+			cputemp_note(LOG_NOTICE, "Cannot learn CPU temperature sensor update cadence (%d value changes in %ds), trying again in %.0fs",
+				nchg, CADENCELEARNSECS, relearnsecs);
+			cadence_giveup(t);
+		}
+		break;
+	case CADENCE_LOCKED:
+		// move the anchor to the last expected update before t
+		upd+=floor((t-upd)/period)*period;
+		off=t-upd;
+		stalesum+=off;
+		stalen++;
+		if(off<(CADENCEMARGINUS+CADENCEPROBEUS)/1e6) { // this read was aligned to the update
+			if(!dup) {
+				upd-=CADENCENUDGEUS/1e6; // fresh, try a little earlier next time
+				dupsrow=0;
+				misses=0;
+			} else if(misses>0) { // the value does change, but after we look: too early, the update is later than we thought
+				upd+=CADENCEMARGINUS/1e6;
+				if(++dupsrow>=CADENCEMAXDUPS && misses>=CADENCEMINMISSES) {
+					cputemp_note(LOG_NOTICE, "CPU temperature sensor lost its update phase, learning it again in %.0fs", relearnsecs);
+					cadence_giveup(t);
+					break;
+				}
+			} // else a steady temperature, a quantised sensor reads the same
+		} else if(!dup && lastread>=upd) { // changed after the expected update of this period
+			misses++;
+		}
+		if(t>=cadencet) { // locked until the periodic relearn: the backoff starts over
+			relearnsecs=CADENCERELEARNSECS;
+			cadence_learn(t);
+		}
+		break;
+	default:
+		if(t>=cadencet) cadence_learn(t);
+	}
+	lastm=m;
+	lastmvalid=1;
+	lastread=t;
+}
+
 /**
- * close file descriptor
+ * Return how many useconds to sleep before the next reading, at most su, so that it happens just after a sensor update
  */
-void cputemp_close(void) {
-	if(cpufd!=-1) return;
-	close(cpufd);
-	cpufd=-1;
+useconds_t cputemp_schedule(useconds_t su) {
+	struct timespec now;
+	double t, next;
+	
+	switch(cadence) {
+	case CADENCE_LEARNING:
+		return (su<CADENCEPROBEUS) ? su : CADENCEPROBEUS;
+	case CADENCE_LOCKED:
+		clock_gettime(CLOCK_BOOTTIME, &now);
+		t=ts2d(&now);
+		// the last expected update (plus margin) not later than t+su
+		next=upd+CADENCEMARGINUS/1e6;
+		next+=floor((t+su/1e6-next)/period)*period;
+		if(next<=t) return su; // no update before t+su, the controller wakes up for something else
+		return (useconds_t)((next-t)*1e6);
+	default:
+		return su;
+	}
 }
 
 /**
- * Get CPU temperature storing it into T and return -1 on errors or 0 on success
+ * Get the filtered CPU temperature storing it into T. If the sensor is not healthy T is the last good one.
+ * Return -1 if the sensor failed or 0 on success
  */
 int getcputemp(double *T) {
-	ssize_t r;
-	char b[8];
+	char b[16];
 	double t;
-	int fd;
+	char *e;
+	long m;
+	int fd, side;
+	struct timespec now;
 	
-	fd=cputemp_fd();
+	clock_gettime(CLOCK_BOOTTIME, &now);
+	fd=cputemp_fd(&now);
 	if(fd<0) {
-		fprintf(stderr, "Error opening cputemp sysfile %s: %s\n", CPUTEMPSYSFILE, strerror(errno));
-		return -1;
+		if(now.tv_sec>=reopent.tv_sec) cputemp_error(&now, "opening");
+		goto bad;
 	}
-	r=pread(fd, b, 7, 0); // read up to 7 bytes from CPUTEMPSYSFILE putting data into b
-	if(r<0) {
-		fprintf(stderr, "Error reading from cputemp sysfile %s: %s\n", CPUTEMPSYSFILE, strerror(errno));
-		close(fd);
-		return -1;
+	if(sysfs_read(fd, b, sizeof(b))<=0) {
+		cputemp_error(&now, "reading from");
+		goto bad;
+	}
+	reads++;
+	m=strtol(b, &e, 10);
+	t=m/1000.0; // number was expressed in millidegree Celsius, porting it to degree Celsius
+	if(e==b || t<SENSORMIN || t>SENSORMAX) {
+		rejected++;
+		goto bad;
 	}
+	backoff=REOPENMINSECS;
+	sedlsf=0;
+	cadence_update(m, ts2d(&now));
+	if(health==SENSOR_FAILED) { // the last good reading is stale, start over
+		mpos=mfill=0;
+		tfvalid=0;
+	}
+	
+	// reject outliers unless they persist, this way a real step is followed OUTLIERCONFIRM readings later
+	if(tfvalid && (t-Tf>OUTLIERDELTA || Tf-t>OUTLIERDELTA)) {
+		side=(t>Tf) ? 1 : -1;
+		outliers=(side==outlierside) ? outliers+1 : 1;
+		outlierside=side;
+		if(outliers<OUTLIERCONFIRM) {
+			rejected++;
+			goto bad;
+		}
+		mpos=mfill=0; // real step: restart the filter from here
+		tfvalid=0;
+	}
+	outliers=0;
 	
-	//printf("b: %s\n", b);
-	sscanf(b, "%lf", &t); // convert string to a number
-	t /= 1000; // number was expressed in millidegree Celsius, porting it to degree Celsius
-	*T=t;
+	Tf=cputemp_filter(t);
+	tfvalid=1;
+	goodt=now;
+	health=SENSOR_OK;
+	*T=Tf;
 	
 	return 0;
+	
+bad:
+	if(tfvalid && now.tv_sec-goodt.tv_sec<SENSORFAILSECS) { // keep going with the last good one for a while
+		health=SENSOR_DEGRADED;
+		*T=Tf;
+		return 0;
+	}
+	health=SENSOR_FAILED;
+	if(tfvalid) *T=Tf;
+	
+	return -1;
+}
+
+/**
+ * Seed the noise filter with the temperature T filtered before a restart
+ */
+void cputemp_seed(double T) {
+	int i;
+	
+	for(i=0; i<mlen; i++) {
+		mwin[i]=T;
+	}
+	mpos=0;
+	mfill=mlen;
+	Tf=T;
+	tfvalid=1;
+	clock_gettime(CLOCK_BOOTTIME, &goodt);
+	health=SENSOR_DEGRADED; // until the first reading
+}
+
+/**
+ * Take a snapshot of the sensor counters into s
+ */
+void cputemp_stats(struct sensorstats *s) {
+	s->health=health;
+	s->cadence=cadence;
+	s->reads=reads;
+	s->errors=errors;
+	s->rejected=rejected;
+	s->reopens=reopens;
+	s->dups=dups;
+	s->period=period;
+	s->staleness=(stalen>0) ? stalesum/stalen : 0;
+	s->notes=notes;
+	s->noteprio=noteprio;
+	memcpy(s->note, note, sizeof(s->note));
+}
+
+/**
+ * Log the sensor messages new in the snapshot s, from the control thread
+ */
+void cputemp_report(const struct sensorstats *s) {
+	static unsigned long seen=0;
+	
+	if(s->notes==seen) return;
+	if(s->notes-seen>1) tlog(LOG_NOTICE, "%lu CPU temperature sensor messages skipped", s->notes-seen-1);
+	tlog(s->noteprio, "%s", s->note);
+	seen=s->notes;
+}
+
+/**
+ * Append the sensor counters snapshot s to the status report
+ */
+void cputemp_status(const struct sensorstats *s) {
+	static const char *hnames[]={"ok", "degraded", "failed"};
+	static const char *cnames[]={"unknown", "learning", "locked", "continuous"};
+	
+	status_add("sensor_health", "%s", hnames[s->health]);
+	status_add("sensor_reads", "%lu", s->reads);
+	status_add("sensor_errors", "%lu", s->errors);
+	status_add("sensor_rejected", "%lu", s->rejected);
+	status_add("sensor_reopens", "%lu", s->reopens);
+	status_add("sensor_duplicates", "%lu", s->dups);
+	status_add("sensor_cadence", "%s", cnames[s->cadence]);
+	if(s->cadence==CADENCE_LOCKED || s->cadence==CADENCE_CONTINUOUS) {
+		status_add("sensor_period_ms", "%.0f", s->period*1000);
+	}
+	if(s->staleness>0) {
+		status_add("sensor_staleness_ms", "%.1f", s->staleness*1000);
+	}
+}
+
+/**
+ * close file descriptor
+ */
+void cputemp_close(void) {
+	if(cpufd==-1) return;
+	close(cpufd);
+	cpufd=-1;
 }
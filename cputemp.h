@@ -37,11 +37,68 @@
  * IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <sys/types.h>
+
+// sensor health
+#define SENSOR_OK 0 // fresh readings
+#define SENSOR_DEGRADED 1 // transient errors or outliers, the last good reading is being used
+#define SENSOR_FAILED 2 // no good reading for SENSORFAILSECS seconds: fail safe, don't trust T
+
+// after these many seconds without a good reading the sensor is failed
+#define SENSORFAILSECS 5
+// default noise filter
+#define SENSORFILTER "median:3"
+// sensor log message length
+#define SENSORNOTELEN 160
+
+// sensor counters, a snapshot taken where the sensor is read for the status report
+struct sensorstats {
+	int health; // SENSOR_OK, SENSOR_DEGRADED or SENSOR_FAILED
+	int cadence;
+	unsigned long reads, errors, rejected, reopens, dups;
+	double period; // sensor update period (seconds)
+	double staleness; // mean age of the values read while locked to the cadence (seconds), 0 if unknown
+	unsigned long notes; // log messages so far, the sensor thread never logs itself
+	int noteprio; // the last one, syslog priority and text
+	char note[SENSORNOTELEN];
+};
+
 /**
- * Get CPU temperature storing it into T and return -1 on errors or 0 on success
+ * Setup the noise filter: "none", "median:N" (N odd, 3 to 7) or "ewma:A" (0 < A <= 1). Return -1 on invalid filters
+ */
+int cputemp_setfilter(const char *spec);
+
+/**
+ * Get the filtered CPU temperature storing it into T. If the sensor is not healthy T is the last good one.
+ * Return -1 if the sensor failed or 0 on success
  */
 int getcputemp(double *T);
 
+/**
+ * Seed the noise filter with the temperature T filtered before a restart
+ */
+void cputemp_seed(double T);
+
+/**
+ * Return how many useconds to sleep before the next reading, at most su, so that it happens just after a sensor update
+ */
+useconds_t cputemp_schedule(useconds_t su);
+
+/**
+ * Take a snapshot of the sensor counters into s
+ */
+void cputemp_stats(struct sensorstats *s);
+
+/**
+ * Log the sensor messages new in the snapshot s, from the control thread
+ */
+void cputemp_report(const struct sensorstats *s);
+
+/**
+ * Append the sensor counters snapshot s to the status report
+ */
+void cputemp_status(const struct sensorstats *s);
+
 /**
  * close file descriptor
  */
@@ -39,7 +39,20 @@
 
 #include "common.h"
 #include <signal.h>
+#include <limits.h>
+#include "sysfs.h"
 #include "cputemp.h"
+#include "load.h"
+#include "throttle.h"
+#include "status.h"
+#include "cgroup.h"
+#include "cpufreq.h"
+#include "pipeline.h"
+#include "telemetry.h"
+#include "health.h"
+#include "policy.h"
+#include "ckpt.h"
+#include "notify.h"
 #include "fan.h"
 #include "daemon.h"
 #include "controller.h"
@@ -54,6 +67,8 @@
 atomic_int e_flag = ATOMIC_VAR_INIT(0);
 // fan at maximum speed for a while
 atomic_int fanonforawhile = ATOMIC_VAR_INIT(0);
+// when fanChat started (CLOCK_BOOTTIME)
+struct timespec tstart;
 
 static void shutdown_by_signal(int signum, siginfo_t *info, void *ptr) {
 	//fprintf(stderr, "got trapped signal, going to terminate\n");
@@ -158,8 +173,11 @@ static void daemonise(void) {
 		fprintf(stderr, "Failed to reopen stderr while daemonising: %s\n", strerror(errno));
 		_exit(1);
 	}
-	
+}
+
+static void setup_signals(void) {
 	int i;
+	
 	for(i=1; i<=31 ;i++) { // ignore all possibile ignorable signals
 		signal(i, SIG_IGN);
 	}
@@ -170,33 +188,141 @@ static void daemonise(void) {
 	catch_sigusr1();
 }
 
+static void usage(const char *argv0) {
+	fprintf(stderr, "Usage: %s [-fFhP] [-c cgroup] [-C policy] [-g device] [-k checkpoint] [-r rootdir] [-s statusfile] [-S statedir] [-t filter]\n", argv0);
+	fprintf(stderr, "  -c cgroup      slow down this cgroup v2 directory (e.g. /sys/fs/cgroup/batch.slice) close to the firmware throttling temperature\n");
+	fprintf(stderr, "  -C policy      load the temperature policy (watermarks, trigger timeout, fan speed steps) from this file, see fanChat-tune\n");
+	fprintf(stderr, "  -f             stay in the foreground (implied when started by systemd with Type=notify)\n");
+	fprintf(stderr, "  -F             lower the CPU frequency ceiling when the fan at its top step isn't enough, before the firmware throttles\n");
+	fprintf(stderr, "  -g device      map the PWM registers from device, a regular file is a mock register file (default: %s)\n", FANDEVICE);
+	fprintf(stderr, "  -h             show this help\n");
+	fprintf(stderr, "  -k checkpoint  checkpoint the controller state for warm restarts in this file, better on tmpfs (default: %s)\n", CKPTFILE);
+	fprintf(stderr, "  -P             pipelined: sensing, control and telemetry (logs, title, status) run in their own threads\n");
+	fprintf(stderr, "  -r rootdir     look up /proc and /sys files below rootdir (testing with fake files)\n");
+	fprintf(stderr, "  -s statusfile  write the daemon status to statusfile (default: %s)\n", STATUSFILE);
+	fprintf(stderr, "  -S statedir    keep the state that survives restarts (cooling baseline, limit records) in statedir (default: %s)\n", STATEDIR);
+	fprintf(stderr, "  -t filter      temperature noise filter: none, median:N (N odd, 3-7) or ewma:A (0<A<=1) (default: %s)\n", SENSORFILTER);
+}
+
 int main(int argc, char *argv[]) {
 	int ret;
 	double T;
+	const char *cgroup=NULL;
+	const char *statedir=STATEDIR;
+	char path[PATH_MAX];
+	int pipelined=0;
+	int foreground=0;
+	int freqceiling=0;
+	struct policy pol=policy_default;
+	struct ckpt ck;
+	int warm;
+	
+	clock_gettime(CLOCK_BOOTTIME, &tstart);
 	
 #if ATOMIC_INT_LOCK_FREE == 1
 	if (!atomic_is_lock_free(&e_flag)) {
 		return EXIT_FAILURE;
 	}
 #endif
+	cputemp_setfilter(SENSORFILTER);
+	while((ret=getopt(argc, argv, "c:C:fFg:hk:Pr:s:S:t:"))!=-1) {
+		switch(ret) {
+		case 'c':
+			cgroup=optarg;
+			break;
+		case 'C':
+			if(policy_load(optarg, &pol)<0) {
+				return 1;
+			}
+			break;
+		case 'f':
+			foreground=1;
+			break;
+		case 'F':
+			freqceiling=1;
+			break;
+		case 'g':
+			fan_setdevice(optarg);
+			break;
+		case 'k':
+			ckpt_setfile(optarg);
+			break;
+		case 'P':
+			pipelined=1;
+			break;
+		case 'r':
+			sysfs_setroot(optarg);
+			break;
+		case 's':
+			status_setfile(optarg);
+			break;
+		case 'S':
+			statedir=optarg;
+			break;
+		case 't':
+			if(cputemp_setfilter(optarg)<0) {
+				fprintf(stderr, "Invalid temperature filter: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	
+	warm=(ckpt_load(&ck)==0); // restarted a moment ago? Carry on from there
+	if(warm) cputemp_seed(ck.T);
 	ret=getcputemp(&T);
 	if(ret<0) {
 		fprintf(stderr, "Cannot read CPU temperature. Sorry.\n");
 		return 1;
 	}
-	printf("RPI CPU temperature is %6.3f C.\nForking to daemon...\n", T);
+	if(mkdir(statedir, 0755)<0 && errno!=EEXIST) {
+		fprintf(stderr, "Cannot create state directory %s: %s\n", statedir, strerror(errno));
+	}
+	snprintf(path, sizeof(path), "%s/cgroup", statedir);
+	if(cgroup!=NULL && cgroup_setup(cgroup, path)<0) {
+		fprintf(stderr, "Cannot use cgroup %s. Sorry.\n", cgroup);
+		return 1;
+	}
+	snprintf(path, sizeof(path), "%s/cpufreq", statedir);
+	if(freqceiling && cpufreq_setup(path)<0) {
+		fprintf(stderr, "Cannot manage the CPU frequency ceiling. Sorry.\n");
+		return 1;
+	}
+	if(notify_open()==0) { // systemd Type=notify: it wants us in the foreground and tells when we are ready
+		foreground=1;
+	}
+	printf("RPI CPU temperature is %6.3f C.\n%s", T, foreground ? "" : "Forking to daemon...\n");
+	fflush(stdout);
 	
 	ret=fan_setup();
 	if(ret<0) {
 		fprintf(stderr, "Cannot initialize fan. Sorry.\n");
 		return 1;
 	}
+	if(warm) fan_set(ck.fan); // don't leave the fan off while starting up
 	
-	daemonise();
+	if(!foreground) daemonise();
+	setup_signals();
 	
 	setlogmask(LOG_UPTO(LOG_NOTICE));
 	openlog(DAEMON_NAME, LOG_PID | LOG_NDELAY, LOG_LOCAL1);
 	syslog(LOG_NOTICE, "%s fan controller started, CPU temp is now %6.3f C.", DAEMON_NAME, T);
+	if(load_open()<0) {
+		syslog(LOG_WARNING, "Cannot read CPU load, load feedforward disabled");
+	}
+	throttle_open();
+	snprintf(path, sizeof(path), "%s/health", statedir);
+	health_load(path);
+	if(pipelined && (telemetry_start()<0 || pipeline_start()<0)) {
+		syslog(LOG_WARNING, "Cannot start the pipeline, running serially");
+		telemetry_stop();
+	}
 	
 	/*
 	int sl=15;
@@ -209,13 +335,25 @@ int main(int argc, char *argv[]) {
 	//if (e_flag) { /* signal trapped, we should exit */ }
 	
 	// the controller's main loop
-	ret=controller();
+	ret=controller(&pol, T, warm ? &ck : NULL);
+	pipeline_stop();
+	telemetry_stop();
 	
-	fan_shutdown();
+	health_save();
+	cgroup_restore();
+	cpufreq_restore();
+	if(ret>0) {
+		fan_release();
+	} else {
+		fan_shutdown();
+	}
 	
 	syslog(LOG_WARNING, "%s fan controller shut down", DAEMON_NAME);
 	cputemp_close();
+	load_close();
+	throttle_close();
+	notify_close();
 	closelog ();
 	
-	return ret;
+	return 0;
 }
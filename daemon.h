@@ -48,8 +48,14 @@
  */
 
 #include <stdatomic.h>
+#include <time.h>
 
 #define DAEMON_NAME "fanChat"
+// where the state that survives restarts is kept
+#define STATEDIR "/var/lib/fanChat"
+
+// when fanChat started (CLOCK_BOOTTIME)
+extern struct timespec tstart;
 
 // exit flag
 extern atomic_int e_flag;
@@ -38,9 +38,24 @@
  */
 
 #include "common.h"
+#include <limits.h>
 #include "fan.h"
+#ifdef USE_PIGPIO
 #include <pigpio.h>
+#else
+#include "pwm.h"
+#endif
 
+static char fandevice[PATH_MAX]=FANDEVICE;
+
+/**
+ * Set the device the PWM registers are mapped from (not used with pigpio)
+ */
+void fan_setdevice(const char *path) {
+	snprintf(fandevice, sizeof(fandevice), "%s", path);
+}
+
+#ifdef USE_PIGPIO
 /**
  * Setup GPIO pin of the fan
  */
@@ -78,12 +93,54 @@ void fan_shutdown(void) {
 	gpioTerminate();
 }
 
+/**
+ * Shut down GPIO leaving the fan at its speed, for a restart to take over
+ */
+void fan_release(void) {
+	// pigpio times the PWM with DMA, which stops here: the pin keeps its last level until the restart
+	gpioTerminate();
+}
+
 /**
  * Set fan to p%
  */
 void fan_set(unsigned short p) {
-	if(p<0) p=0;
 	if(p>100) p=100;
 	// 255 is 100%
 	gpioPWM(18, 255*p/100);
 }
+#else
+/**
+ * Setup GPIO pin of the fan
+ */
+int fan_setup(void) {
+	// GPIO 18 as hardware PWM, fan off
+	if(pwm_open(fandevice)<0) {
+		fprintf(stderr, "Fatal error on initializing the PWM registers, required to handle fan\n");
+		return -1;
+	}
+	
+	return 0;
+}
+
+/**
+ * Stop fan and shut down GPIO
+ */
+void fan_shutdown(void) {
+	pwm_close();
+}
+
+/**
+ * Shut down GPIO leaving the fan at its speed, for a restart to take over
+ */
+void fan_release(void) {
+	pwm_release();
+}
+
+/**
+ * Set fan to p%
+ */
+void fan_set(unsigned short p) {
+	pwm_set(p);
+}
+#endif
@@ -37,6 +37,14 @@
  * IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+// where the PWM registers are mapped from
+#define FANDEVICE "/dev/mem"
+
+/**
+ * Set the device the PWM registers are mapped from (not used with pigpio)
+ */
+void fan_setdevice(const char *path);
+
 /**
  * Setup GPIO pin of the fan
  */
@@ -45,6 +53,10 @@ int fan_setup(void);
  * Stop fan and shut down GPIO
  */
 void fan_shutdown(void);
+/**
+ * Shut down GPIO leaving the fan at its speed, for a restart to take over
+ */
+void fan_release(void);
 /**
  * Set fan to p%
  */
@@ -0,0 +1,327 @@
+/**
+ * Author: Dino Ciuffetti - dam2000 at gmail dot com
+ * Home: https://github.com/dam2k/fanChat
+ * Date: 2019-10-27
+ * Whatis: Melopero's FanHat Raspberry Pi FAN controller daemon rethinked from scratch and written in C
+ * Work with: Melopero FAN HAT for Raspberry Pi 4
+ *   https://www.melopero.com/shop/melopero-engineering/melopero-fan-hat-for-raspberry-pi-4/
+ * Requires: PiGpio library: http://abyz.me.uk/rpi/pigpio/ - apt update && apt install libpigpio-dev
+ * Replaces: official fan driver written in python: https://www.melopero.com/fan-hat/
+ * License: MIT License - https://opensource.org/licenses/MIT
+ *
+ * Notes:
+ * The Melopero FAN HAT for Raspberry Pi 4 is a cool (freddo!! :-)) fan driver for Raspberry Pi 4. It works using GPIO PIN 18 that
+ * has hardware driven PWM capabilities. This way they can handle fan speed changing the PIN's duty cycle.
+ * We continuously read the CPU temperature thanks to the /sys/class/thermal/thermal_zone0/temp file and we take care of cooling
+ * the CPU by setting up the right fan speed modulating the pin's PWM attached to the fan hat.
+ * Since I really hate when the fan is always on at low speed, I thinked of using a high and low watermarks.
+ * If the cpu's temperature is below the LW the fan will be shut down, and when the cpu's temperature raises above the HW the fan
+ * will come into play at the right speed. Also, there is a trigger timeout that will fire if the fan is down for more then a few
+ * minutes after the LW event. In this way we can cool down the RPI's temperature a little bit without reaching the HW or
+ * stressing us too much. Enjoy it!!
+ */
+
+/**
+ * Copyright 2019 Dino Ciuffetti - dam2000 at gmail dot com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+ * IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "common.h"
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#include "sysfs.h"
+#include "status.h"
+#include "telemetry.h"
+#include "health.h"
+
+/*
+  Newton's law of cooling: dT/dt = q - k*(T - Tambient). With the fan at a steady speed and a steady load, the drop rate -dT/dt
+  measured over windows of HEALTHWINDOWSECS is linear in T and its slope is the cooling constant k (1/s). k is fitted per fan speed
+  and load bin by a least squares regression over a baseline (learned once, then frozen) and over the recent measures: a dusty fan
+  or a worn bearing shows up as a current k falling below the baseline. The intercept takes the room temperature and the heat
+  produced only while they are steady: windows pooled across room temperatures and the loads within a coarse bin add noise to k,
+  hence the alert margin and the many measures a bin needs. The efficiency weighs the bins by their recent measures and leaves the
+  fan off bin out: the fan is off most of the time and that bin measures the heatsink alone. State is constant size and every
+  sample costs O(1).
+*/
+#define BOARDSERIALFILE "/proc/device-tree/serial-number"
+#define HEALTHMAGIC "fanChatH"
+#define HEALTHVERSION 1
+
+#define HEALTHDUTYBINS 11 // fan speed / 10
+#define HEALTHLOADBINS 3 // sustained load < 20%, < 50%, more
+// measure over windows this long (seconds)
+#define HEALTHWINDOWSECS 20
+// the recent regression follows the measures with this factor
+#define HEALTHCURALPHA 0.05
+// the baseline is learned from these many measures, and a bin is trusted after them
+#define HEALTHMINSAMPLES 30
+// fit k only when the temperatures spread at least this much (C^2), less it's just noise
+#define HEALTHMINVAR 1.0
+// alert when the current k falls below this share of the baseline, clear it above this one
+#define HEALTHALERTRATIO 0.7
+#define HEALTHCLEARRATIO 0.8
+// persist the baseline this often (seconds)
+#define HEALTHSAVESECS 3600
+// the bins weigh in the efficiency by their recent measures, fading by this factor at every measure (half in about 2 hours of them)
+#define HEALTHRECENTALPHA 0.002
+
+// weighted sums for the regression of the drop rate y on the temperature x
+struct hreg {
+	double w, x, y, xx, xy;
+};
+
+struct hbin {
+	uint32_t n; // measures
+	struct hreg base; // baseline
+	struct hreg cur; // recent measures
+	double k; // last current k fitted
+};
+
+// what is persisted
+struct hstate {
+	char magic[8];
+	uint32_t version;
+	char board[32]; // board serial number
+	struct hbin bins[HEALTHDUTYBINS][HEALTHLOADBINS];
+};
+
+static struct hstate hs;
+// the baseline handed over to the telemetry thread, pending until written
+static struct hstate phs;
+static atomic_int pending=ATOMIC_VAR_INIT(0);
+
+static char healthfile[PATH_MAX]="";
+// measure window
+static int wvalid=0, wd, wl;
+static double wt, wT;
+static double ratio=1; // current/baseline k with the fan running
+static double pratio=-1; // the same with the fan off (heatsink alone), -1 if unknown
+static double recent[HEALTHDUTYBINS][HEALTHLOADBINS]; // fading count of the recent measures of each bin, since startup
+static int alert=0;
+static time_t tsave=0;
+
+static double nows(void) {
+	struct timespec t;
+	
+	clock_gettime(CLOCK_BOOTTIME, &t);
+	return t.tv_sec+t.tv_nsec/1e9;
+}
+
+// move the regression towards the measure (x, y) by factor a
+static void health_fit(struct hreg *r, double x, double y, double a) {
+	r->w+=a*(1-r->w);
+	r->x+=a*(x-r->x);
+	r->y+=a*(y-r->y);
+	r->xx+=a*(x*x-r->xx);
+	r->xy+=a*(x*y-r->xy);
+}
+
+// the cooling constant k of a regression, or -1 if the temperatures don't spread enough
+static double health_k(const struct hreg *r) {
+	double mx, var;
+	
+	if(r->w<=0) return -1;
+	mx=r->x/r->w;
+	var=r->xx/r->w-mx*mx;
+	if(var<HEALTHMINVAR) return -1;
+	
+	return (r->xy/r->w-mx*r->y/r->w)/var;
+}
+
+// current/baseline k over the trusted bins of fan speeds d0 to d1, weighted by their recent measures. Return -1 if unknown
+static double health_ratio(int d0, int d1) {
+	struct hbin *h;
+	double c=0, b=0, kb;
+	int d, l;
+	
+	for(d=d0; d<=d1; d++) {
+		for(l=0; l<HEALTHLOADBINS; l++) {
+			h=&hs.bins[d][l];
+			if(h->n<HEALTHMINSAMPLES) continue;
+			kb=health_k(&h->base);
+			if(kb<=0 || h->k<0) continue;
+			c+=recent[d][l]*h->k;
+			b+=recent[d][l]*kb;
+		}
+	}
+	
+	return (b>0) ? c/b : -1;
+}
+
+/**
+ * Load the cooling baseline of this board from path (a missing or foreign file starts a new baseline).
+ * Return -1 on errors or 0 on success
+ */
+int health_load(const char *path) {
+	char board[sizeof(hs.board)];
+	int fd;
+	ssize_t r;
+	
+	snprintf(healthfile, sizeof(healthfile), "%s", path);
+	board[0]='\0';
+	fd=sysfs_open(BOARDSERIALFILE, O_RDONLY);
+	if(fd>=0) {
+		sysfs_read(fd, board, sizeof(board));
+		close(fd);
+	}
+	if(board[0]=='\0') snprintf(board, sizeof(board), "unknown");
+	board[strcspn(board, "\n")]='\0';
+	
+	memset(&hs, 0, sizeof(hs));
+	fd=open(healthfile, O_RDONLY);
+	if(fd>=0) {
+		r=read(fd, &hs, sizeof(hs));
+		close(fd);
+		if(r!=sizeof(hs) || memcmp(hs.magic, HEALTHMAGIC, sizeof(hs.magic))!=0 || hs.version!=HEALTHVERSION) {
+			syslog(LOG_WARNING, "Ignoring invalid cooling baseline %s", healthfile);
+			memset(&hs, 0, sizeof(hs));
+		} else if(strncmp(hs.board, board, sizeof(hs.board))!=0) {
+			syslog(LOG_NOTICE, "Cooling baseline %s belongs to board %.32s, starting a new one", healthfile, hs.board);
+			memset(&hs, 0, sizeof(hs));
+		}
+	} else if(errno!=ENOENT) {
+		syslog(LOG_WARNING, "Cannot read cooling baseline %s: %s", healthfile, strerror(errno));
+	}
+	memcpy(hs.magic, HEALTHMAGIC, sizeof(hs.magic));
+	hs.version=HEALTHVERSION;
+	snprintf(hs.board, sizeof(hs.board), "%s", board);
+	tsave=(time_t)nows();
+	ratio=1; // until recent measures compare with the baseline
+	pratio=-1;
+	
+	return 0;
+}
+
+// write the baseline handed over by health_save()
+static void health_flush(void) {
+	char tmp[PATH_MAX+4];
+	int fd;
+	ssize_t r;
+	
+	if(!atomic_load_explicit(&pending, memory_order_acquire)) return;
+	snprintf(tmp, sizeof(tmp), "%s.tmp", healthfile);
+	fd=open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd<0) {
+		tlog(LOG_ERR, "Cannot save cooling baseline %s: %s", tmp, strerror(errno));
+		goto done;
+	}
+	r=write(fd, &phs, sizeof(phs));
+	close(fd);
+	if(r!=sizeof(phs) || rename(tmp, healthfile)<0) {
+		tlog(LOG_ERR, "Cannot save cooling baseline %s: %s", healthfile, strerror(errno));
+		unlink(tmp);
+	}
+	
+done:
+	atomic_store_explicit(&pending, 0, memory_order_release);
+}
+
+/**
+ * Persist the cooling baseline, written by the telemetry thread if it's running.
+ * Return -1 if there is nowhere to save it or the previous one is still being written, 0 on success
+ */
+int health_save(void) {
+	if(healthfile[0]=='\0' || atomic_load_explicit(&pending, memory_order_acquire)) return -1;
+	phs=hs;
+	atomic_store_explicit(&pending, 1, memory_order_release);
+	if(tcall(health_flush)<0) {
+		atomic_store_explicit(&pending, 0, memory_order_release);
+		return -1;
+	}
+	
+	return 0;
+}
+
+/**
+ * Model the cooling response from a sample: temperature T, fan speed p (%) and sustained CPU load L (0..1)
+ */
+void health_sample(double T, int p, double L) {
+	struct hbin *h;
+	double t, Tm, y;
+	int d, l, i, j;
+	
+	t=nows();
+	d=p/10;
+	l=(L<0.2) ? 0 : ((L<0.5) ? 1 : 2);
+	if(!wvalid || d!=wd || l!=wl) { // start a new window
+		wvalid=1;
+		wd=d;
+		wl=l;
+		wt=t;
+		wT=T;
+		return;
+	}
+	if(t-wt<HEALTHWINDOWSECS) return;
+	
+	Tm=(T+wT)/2;
+	y=-(T-wT)/(t-wt);
+	h=&hs.bins[d][l];
+	if(h->n<HEALTHMINSAMPLES || health_k(&h->base)<0) { // still learning the baseline: plain average until it's a valid fit, then frozen
+		health_fit(&h->base, Tm, y, 1.0/(h->n+1));
+	}
+	health_fit(&h->cur, Tm, y, (h->n<HEALTHMINSAMPLES) ? 1.0/(h->n+1) : HEALTHCURALPHA);
+	if(health_k(&h->cur)>=0 || h->n==0) h->k=health_k(&h->cur); // keep the last fit while the temperatures don't spread
+	if(h->n<UINT32_MAX) h->n++;
+	wt=t;
+	wT=T;
+	for(i=0; i<HEALTHDUTYBINS; i++) {
+		for(j=0; j<HEALTHLOADBINS; j++) {
+			recent[i][j]*=1-HEALTHRECENTALPHA;
+		}
+	}
+	recent[d][l]+=1;
+	
+	// the fan is what wears out: the fan off bin, most of the time by design, would hide it
+	ratio=health_ratio(1, HEALTHDUTYBINS-1);
+	pratio=health_ratio(0, 0);
+	if(ratio<0) ratio=1;
+	if(!alert && ratio<HEALTHALERTRATIO) {
+		tlog(LOG_WARNING, "Cooling efficiency dropped to %.0f%% of this board's baseline: fan dusty or worn? Temp %2.1f C, fan at %d%%", ratio*100, T, p);
+		alert=1;
+	} else if(alert && ratio>=HEALTHCLEARRATIO) {
+		tlog(LOG_NOTICE, "Cooling efficiency back to %.0f%% of this board's baseline", ratio*100);
+		alert=0;
+	}
+	
+	if((time_t)t-tsave>=HEALTHSAVESECS) {
+		health_save();
+		tsave=(time_t)t;
+	}
+}
+
+/**
+ * Append cooling health analytics to the status report
+ */
+void health_status(void) {
+	struct hbin *h=&hs.bins[0][0];
+	unsigned long n=0;
+	int i;
+	
+	if(healthfile[0]=='\0') return;
+	for(i=0; i<HEALTHDUTYBINS*HEALTHLOADBINS; i++, h++) {
+		n+=h->n;
+	}
+	status_add("cooling_board", "%s", hs.board);
+	status_add("cooling_measures", "%lu", n);
+	status_add("cooling_efficiency", "%.0f", ratio*100);
+	if(pratio>=0) {
+		status_add("cooling_passive_efficiency", "%.0f", pratio*100);
+	} else {
+		status_add("cooling_passive_efficiency", "unknown");
+	}
+	status_add("cooling_alert", "%d", alert);
+}
@@ -0,0 +1,215 @@
+/**
+ * Author: Dino Ciuffetti - dam2000 at gmail dot com
+ * Home: https://github.com/dam2k/fanChat
+ * Date: 2019-10-27
+ * Whatis: Melopero's FanHat Raspberry Pi FAN controller daemon rethinked from scratch and written in C
+ * Work with: Melopero FAN HAT for Raspberry Pi 4
+ *   https://www.melopero.com/shop/melopero-engineering/melopero-fan-hat-for-raspberry-pi-4/
+ * Requires: PiGpio library: http://abyz.me.uk/rpi/pigpio/ - apt update && apt install libpigpio-dev
+ * Replaces: official fan driver written in python: https://www.melopero.com/fan-hat/
+ * License: MIT License - https://opensource.org/licenses/MIT
+ *
+ * Notes:
+ * The Melopero FAN HAT for Raspberry Pi 4 is a cool (freddo!! :-)) fan driver for Raspberry Pi 4. It works using GPIO PIN 18 that
+ * has hardware driven PWM capabilities. This way they can handle fan speed changing the PIN's duty cycle.
+ * We continuously read the CPU temperature thanks to the /sys/class/thermal/thermal_zone0/temp file and we take care of cooling
+ * the CPU by setting up the right fan speed modulating the pin's PWM attached to the fan hat.
+ * Since I really hate when the fan is always on at low speed, I thinked of using a high and low watermarks.
+ * If the cpu's temperature is below the LW the fan will be shut down, and when the cpu's temperature raises above the HW the fan
+ * will come into play at the right speed. Also, there is a trigger timeout that will fire if the fan is down for more then a few
+ * minutes after the LW event. In this way we can cool down the RPI's temperature a little bit without reaching the HW or
+ * stressing us too much. Enjoy it!!
+ */
+
+/**
+ * Copyright 2019 Dino Ciuffetti - dam2000 at gmail dot com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+ * IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "common.h"
+#include <time.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include "sysfs.h"
+#include "telemetry.h"
+#include "load.h"
+
+#define PSICPUFILE "/proc/pressure/cpu"
+#define STATFILE "/proc/stat"
+
+// wake up the controller when tasks stall waiting for a CPU for 150ms in a 1s window (root only)
+#define PSITRIGGER "some 150000 1000000"
+// sustained load follows a load increase with this time constant (seconds)...
+#define LOADRISETAU 8.0
+// ...and a load decrease with this one (seconds)
+#define LOADFALLTAU 1.0
+
+static int psifd=-1; // PSI cpu file descriptor
+static int psitrgfd=-1; // PSI cpu trigger file descriptor
+static int statfd=-1; // /proc/stat file descriptor
+static atomic_int trgfailed=ATOMIC_VAR_INIT(0); // the PSI trigger was disarmed, to be logged by the control thread
+
+// previous sample
+static struct {
+	int valid, psiok, statok;
+	struct timespec t;
+	unsigned long long psitotal; // usecs
+	unsigned long long busy, total; // jiffies
+	double sustained;
+} prev;
+
+/**
+ * Open the CPU load sources and arm a PSI trigger if possible. Return -1 if no load source is available
+ */
+int load_open(void) {
+	statfd=sysfs_open(STATFILE, O_RDONLY);
+	psifd=sysfs_open(PSICPUFILE, O_RDONLY);
+	if(psifd<0) {
+		syslog(LOG_NOTICE, "CPU pressure (PSI) not available (%s), boot with psi=1 to enable it", strerror(errno));
+	} else {
+		psitrgfd=sysfs_open(PSICPUFILE, O_RDWR | O_NONBLOCK);
+		if(psitrgfd>=0 && write(psitrgfd, PSITRIGGER, strlen(PSITRIGGER)+1)<0) {
+			syslog(LOG_NOTICE, "Cannot arm CPU pressure trigger: %s", strerror(errno));
+			close(psitrgfd);
+			psitrgfd=-1;
+		}
+	}
+	prev.valid=0;
+	
+	return (statfd<0 && psifd<0) ? -1 : 0;
+}
+
+/**
+ * close file descriptors
+ */
+void load_close(void) {
+	if(psitrgfd!=-1) close(psitrgfd);
+	if(psifd!=-1) close(psifd);
+	if(statfd!=-1) close(statfd);
+	psitrgfd=psifd=statfd=-1;
+}
+
+// read "some ... total=N" from the PSI file. Return -1 on errors
+static int psi_total(unsigned long long *total) {
+	char b[128];
+	const char *p;
+	
+	if(psifd<0 || sysfs_read(psifd, b, sizeof(b))<0) return -1;
+	p=strstr(b, "total=");
+	if(p==NULL || sysfs_parseull(p+6, total)==NULL) return -1;
+	
+	return 0;
+}
+
+// read busy and total jiffies of the aggregated "cpu" line of /proc/stat. Return -1 on errors
+static int stat_jiffies(unsigned long long *busy, unsigned long long *total) {
+	char b[256];
+	const char *p;
+	unsigned long long v[8]; // user nice system idle iowait irq softirq steal
+	int i;
+	
+	if(statfd<0 || sysfs_read(statfd, b, sizeof(b))<0) return -1;
+	if(strncmp(b, "cpu ", 4)!=0) return -1;
+	p=b+4;
+	*total=0;
+	for(i=0; i<8; i++) {
+		p=sysfs_parseull(p, &v[i]);
+		if(p==NULL) return -1;
+		*total+=v[i];
+	}
+	*busy=*total-v[3]-v[4]; // idle and iowait are not busy
+	
+	return 0;
+}
+
+/**
+ * Sample the CPU load storing it into l. Return -1 on errors or 0 on success
+ */
+int load_sample(struct cpuload *l) {
+	struct timespec now;
+	unsigned long long psitotal=0, busy=0, total=0;
+	int psiok, statok;
+	double dt, L, a;
+	
+	clock_gettime(CLOCK_BOOTTIME, &now);
+	psiok=(psi_total(&psitotal)==0);
+	statok=(stat_jiffies(&busy, &total)==0);
+	if(!psiok && !statok) {
+		prev.valid=0;
+		return -1;
+	}
+	
+	l->util=0;
+	l->psi=0;
+	l->sustained=prev.valid ? prev.sustained : 0;
+	dt=(now.tv_sec-prev.t.tv_sec)+(now.tv_nsec-prev.t.tv_nsec)/1e9;
+	if(prev.valid && dt>0) {
+		if(statok && prev.statok && total>prev.total) {
+			l->util=(double)(busy-prev.busy)/(total-prev.total);
+		}
+		if(psiok && prev.psiok && psitotal>=prev.psitotal) {
+			l->psi=(psitotal-prev.psitotal)/(dt*1e6);
+			if(l->psi>1) l->psi=1;
+		}
+		L=(l->util>l->psi) ? l->util : l->psi;
+		a=dt/(((L>l->sustained) ? LOADRISETAU : LOADFALLTAU)+dt);
+		l->sustained+=(L-l->sustained)*a;
+	}
+	
+	prev.valid=1;
+	prev.psiok=psiok;
+	prev.statok=statok;
+	prev.t=now;
+	prev.psitotal=psitotal;
+	prev.busy=busy;
+	prev.total=total;
+	prev.sustained=l->sustained;
+	
+	return 0;
+}
+
+/**
+ * Log what happened to the load sources where they are sampled, from the control thread
+ */
+void load_report(void) {
+	if(atomic_load(&trgfailed)==1) {
+		tlog(LOG_WARNING, "CPU pressure trigger failed, disarmed it");
+		atomic_store(&trgfailed, 2);
+	}
+}
+
+/**
+ * Sleep for su useconds, waking up earlier if the PSI trigger fires. Return 1 if woken up by the trigger, otherwise 0
+ */
+int load_wait(useconds_t su) {
+	struct pollfd pfd;
+	
+	if(psitrgfd<0) {
+		usleep(su);
+		return 0;
+	}
+	pfd.fd=psitrgfd;
+	pfd.events=POLLPRI;
+	pfd.revents=0;
+	if(poll(&pfd, 1, su/1000)>0) {
+		if(pfd.revents & POLLPRI) return 1;
+		// trigger is gone or this is not a PSI file (POLLERR, POLLIN...), don't spin on it
+		atomic_store(&trgfailed, 1);
+		close(psitrgfd);
+		psitrgfd=-1;
+		usleep(su);
+	}
+	
+	return 0;
+}
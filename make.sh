@@ -31,9 +31,33 @@
 
 set -x
 
+gcc -O2 -Wall -c -o sysfs.o sysfs.c
 gcc -O2 -Wall -c -o cputemp.o cputemp.c
+gcc -O2 -Wall -c -o load.o load.c
+gcc -O2 -Wall -c -o throttle.o throttle.c
+gcc -O2 -Wall -c -o status.o status.c
+gcc -O2 -Wall -c -o cgroup.o cgroup.c
+gcc -O2 -Wall -c -o cpufreq.o cpufreq.c
+gcc -O2 -Wall -c -o spsc.o spsc.c
+gcc -O2 -Wall -c -o pipeline.o pipeline.c
+gcc -O2 -Wall -c -o telemetry.o telemetry.c $(pkg-config --cflags libbsd-overlay)
+gcc -O2 -Wall -c -o seq.o seq.c
+gcc -O2 -Wall -c -o health.o health.c
+gcc -O2 -Wall -c -o policy.o policy.c
+gcc -O2 -Wall -c -o ckpt.o ckpt.c
+gcc -O2 -Wall -c -o notify.o notify.c
 gcc -O2 -Wall -c -o daemon.o daemon.c
-gcc -O2 -Wall -c -o fan.o fan.c
+# the fan is driven through the PWM registers, PIGPIO=1 ./make.sh drives it through the pigpio library instead
+if [ "$PIGPIO" = "1" ]; then
+	gcc -O2 -Wall -DUSE_PIGPIO -c -o fan.o fan.c
+	LIBPIGPIO="-L/usr/local/lib -Wl,-rpath=/usr/local/lib -lpigpio"
+else
+	gcc -O2 -Wall -c -o pwm.o pwm.c
+	gcc -O2 -Wall -c -o fan.o fan.c
+	PWMO=pwm.o
+fi
 gcc -O2 -Wall -c -o controller.o controller.c $(pkg-config --cflags libbsd-overlay)
 
-gcc -O2 -Wall -o fanChat cputemp.o daemon.o fan.o controller.o -L/usr/local/lib -Wl,-rpath=/usr/local/lib -lpigpio $(pkg-config --cflags libbsd-overlay) $(pkg-config --libs libbsd-overlay) $(pkg-config --libs libbsd-ctor)
+gcc -O2 -Wall -o fanChat sysfs.o cputemp.o load.o throttle.o status.o cgroup.o cpufreq.o spsc.o pipeline.o telemetry.o seq.o health.o policy.o ckpt.o notify.o daemon.o fan.o $PWMO controller.o $LIBPIGPIO $(pkg-config --cflags libbsd-overlay) $(pkg-config --libs libbsd-overlay) $(pkg-config --libs libbsd-ctor) -lm -pthread
+
+gcc -O2 -Wall -o fanChat-tune tune.c policy.o -lm -pthread
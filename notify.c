@@ -0,0 +1,124 @@
+/**
+ * Author: Dino Ciuffetti - dam2000 at gmail dot com
+ * Home: https://github.com/dam2k/fanChat
+ * Date: 2019-10-27
+ * Whatis: Melopero's FanHat Raspberry Pi FAN controller daemon rethinked from scratch and written in C
+ * Work with: Melopero FAN HAT for Raspberry Pi 4
+ *   https://www.melopero.com/shop/melopero-engineering/melopero-fan-hat-for-raspberry-pi-4/
+ * Requires: PiGpio library: http://abyz.me.uk/rpi/pigpio/ - apt update && apt install libpigpio-dev
+ * Replaces: official fan driver written in python: https://www.melopero.com/fan-hat/
+ * License: MIT License - https://opensource.org/licenses/MIT
+ *
+ * Notes:
+ * The Melopero FAN HAT for Raspberry Pi 4 is a cool (freddo!! :-)) fan driver for Raspberry Pi 4. It works using GPIO PIN 18 that
+ * has hardware driven PWM capabilities. This way they can handle fan speed changing the PIN's duty cycle.
+ * We continuously read the CPU temperature thanks to the /sys/class/thermal/thermal_zone0/temp file and we take care of cooling
+ * the CPU by setting up the right fan speed modulating the pin's PWM attached to the fan hat.
+ * Since I really hate when the fan is always on at low speed, I thinked of using a high and low watermarks.
+ * If the cpu's temperature is below the LW the fan will be shut down, and when the cpu's temperature raises above the HW the fan
+ * will come into play at the right speed. Also, there is a trigger timeout that will fire if the fan is down for more then a few
+ * minutes after the LW event. In this way we can cool down the RPI's temperature a little bit without reaching the HW or
+ * stressing us too much. Enjoy it!!
+ */
+
+/**
+ * Copyright 2019 Dino Ciuffetti - dam2000 at gmail dot com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+ * IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "common.h"
+#include <stddef.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "notify.h"
+
+static int nfd=-1;
+static struct sockaddr_un naddr;
+static socklen_t nlen;
+static double wdsecs=0; // watchdog timeout, 0 if disabled
+static double wdlast=0; // last ping
+
+static double nows(void) {
+	struct timespec t;
+	
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec+t.tv_nsec/1e9;
+}
+
+/**
+ * Connect to the service manager if it asked for notifications. Return -1 if it didn't or on errors, 0 on success
+ */
+int notify_open(void) {
+	const char *s, *pid;
+	size_t len;
+	
+	s=getenv("NOTIFY_SOCKET");
+	if(s==NULL || (s[0]!='/' && s[0]!='@')) return -1;
+	len=strlen(s);
+	if(len>=sizeof(naddr.sun_path)) return -1;
+	memset(&naddr, 0, sizeof(naddr));
+	naddr.sun_family=AF_UNIX;
+	memcpy(naddr.sun_path, s, len);
+	if(s[0]=='@') naddr.sun_path[0]='\0'; // abstract socket
+	nlen=offsetof(struct sockaddr_un, sun_path)+len;
+	nfd=socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if(nfd<0) return -1;
+	
+	// the watchdog, if it's meant for us
+	s=getenv("WATCHDOG_USEC");
+	pid=getenv("WATCHDOG_PID");
+	if(s!=NULL && (pid==NULL || strtol(pid, NULL, 10)==getpid())) {
+		wdsecs=strtoull(s, NULL, 10)/1e6;
+		wdlast=nows();
+	}
+	
+	return 0;
+}
+
+/**
+ * Send the message msg (e.g. "READY=1") to the service manager, if any
+ */
+void notify(const char *msg) {
+	if(nfd<0) return;
+	sendto(nfd, msg, strlen(msg), MSG_NOSIGNAL, (struct sockaddr *)&naddr, nlen);
+}
+
+/**
+ * Ping the watchdog if it's time to. Return su, or less if the next ping is due before su useconds
+ */
+useconds_t notify_watchdog(useconds_t su) {
+	double t, left;
+	
+	if(nfd<0 || wdsecs<=0) return su;
+	t=nows();
+	if(t-wdlast>=wdsecs/2) { // ping twice per timeout
+		notify("WATCHDOG=1");
+		wdlast=t;
+	}
+	left=wdlast+wdsecs/2-t;
+	if(left*1e6<su) su=(useconds_t)(left*1e6);
+	
+	return su;
+}
+
+/**
+ * Close the notification socket
+ */
+void notify_close(void) {
+	if(nfd<0) return;
+	close(nfd);
+	nfd=-1;
+}
@@ -0,0 +1,216 @@
+/**
+ * Author: Dino Ciuffetti - dam2000 at gmail dot com
+ * Home: https://github.com/dam2k/fanChat
+ * Date: 2019-10-27
+ * Whatis: Melopero's FanHat Raspberry Pi FAN controller daemon rethinked from scratch and written in C
+ * Work with: Melopero FAN HAT for Raspberry Pi 4
+ *   https://www.melopero.com/shop/melopero-engineering/melopero-fan-hat-for-raspberry-pi-4/
+ * Requires: PiGpio library: http://abyz.me.uk/rpi/pigpio/ - apt update && apt install libpigpio-dev
+ * Replaces: official fan driver written in python: https://www.melopero.com/fan-hat/
+ * License: MIT License - https://opensource.org/licenses/MIT
+ *
+ * Notes:
+ * The Melopero FAN HAT for Raspberry Pi 4 is a cool (freddo!! :-)) fan driver for Raspberry Pi 4. It works using GPIO PIN 18 that
+ * has hardware driven PWM capabilities. This way they can handle fan speed changing the PIN's duty cycle.
+ * We continuously read the CPU temperature thanks to the /sys/class/thermal/thermal_zone0/temp file and we take care of cooling
+ * the CPU by setting up the right fan speed modulating the pin's PWM attached to the fan hat.
+ * Since I really hate when the fan is always on at low speed, I thinked of using a high and low watermarks.
+ * If the cpu's temperature is below the LW the fan will be shut down, and when the cpu's temperature raises above the HW the fan
+ * will come into play at the right speed. Also, there is a trigger timeout that will fire if the fan is down for more then a few
+ * minutes after the LW event. In this way we can cool down the RPI's temperature a little bit without reaching the HW or
+ * stressing us too much. Enjoy it!!
+ */
+
+/**
+ * Copyright 2019 Dino Ciuffetti - dam2000 at gmail dot com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+ * IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "common.h"
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include "spsc.h"
+#include "status.h"
+#include "cputemp.h"
+#include "load.h"
+#include "telemetry.h"
+#include "pipeline.h"
+
+// sensor queue slots (power of two)
+#define SENSORSLOTS 16
+
+// a decimated sample, from the sensor thread to the control thread
+struct sample {
+	double T; // average temperature
+	int ok; // the temperature can be trusted
+	int reads; // readings averaged
+	struct timespec t; // when it was taken
+	struct cpuload cl;
+	struct sensorstats ss; // the sensor thread owns the sensor state, the control thread only gets copies
+};
+
+static struct sample sqbuf[SENSORSLOTS];
+static struct spsc sq;
+static pthread_t sthread;
+static atomic_int srunning=ATOMIC_VAR_INIT(0);
+static atomic_int sstop=ATOMIC_VAR_INIT(0);
+static struct sample last; // latest sample seen by the control thread
+static unsigned long samples=0, reads=0;
+static int stdlsf=0; // don't logspam flag for stale sample messages
+
+static double elapsedus(struct timespec *from, struct timespec *to) {
+	return (to->tv_sec-from->tv_sec)*1e6+(to->tv_nsec-from->tv_nsec)/1e3;
+}
+
+static void *sensor_thread(void *arg) {
+	struct sample s;
+	struct timespec now, tdec;
+	double T, sum=0;
+	int n=0, ok=1, woken=0;
+	useconds_t su;
+	
+	clock_gettime(CLOCK_BOOTTIME, &tdec);
+	while(!sstop) {
+		if(getcputemp(&T)==0) {
+			sum+=T;
+			n++;
+			ok=1;
+		} else {
+			ok=0;
+		}
+		clock_gettime(CLOCK_BOOTTIME, &now);
+		// decimate: time for a new sample, or CPU pressure is rising and the controller should know now
+		if(woken || elapsedus(&tdec, &now)>=DECIMATEUS) {
+			s.ok=ok && n>0;
+			s.T=(n>0) ? sum/n : T;
+			s.reads=n;
+			s.t=now;
+			cputemp_stats(&s.ss);
+			if(load_sample(&s.cl)<0) {
+				s.cl.util=s.cl.psi=s.cl.sustained=0;
+			}
+			spsc_push(&sq, &s); // if the control thread is late the sample is dropped and counted
+			sum=0;
+			n=0;
+			tdec=now;
+		}
+		su=cputemp_schedule(OVERSAMPLEUS);
+		woken=load_wait(su);
+	}
+	
+	return NULL;
+}
+
+/**
+ * Start the sensor thread, oversampling temperature and load and feeding the controller through a lock-free queue.
+ * Return -1 on errors or 0 on success
+ */
+int pipeline_start(void) {
+	sigset_t all, old;
+	int ret;
+	
+	if(spsc_init(&sq, sqbuf, SENSORSLOTS, sizeof(struct sample))<0) {
+		syslog(LOG_ERR, "Cannot setup sensor queue: %s", strerror(errno));
+		return -1;
+	}
+	// a first sample, so that the controller never starts blind
+	last.ok=(getcputemp(&last.T)==0);
+	last.reads=1;
+	clock_gettime(CLOCK_BOOTTIME, &last.t);
+	cputemp_stats(&last.ss);
+	if(load_sample(&last.cl)<0) {
+		last.cl.util=last.cl.psi=last.cl.sustained=0;
+	}
+	// signals are for the control thread
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	sstop=0;
+	ret=pthread_create(&sthread, NULL, sensor_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if(ret!=0) {
+		syslog(LOG_ERR, "Cannot start sensor thread: %s", strerror(ret));
+		spsc_destroy(&sq);
+		return -1;
+	}
+	srunning=1;
+	
+	return 0;
+}
+
+/**
+ * Return 1 if the sensor thread is running
+ */
+int pipeline_running(void) {
+	return srunning;
+}
+
+/**
+ * Get the latest sample from the sensor thread storing temperature into T, load into l and the sensor counters into ss
+ * (unchanged if there's nothing new). Return 1 if the temperature can be trusted, 0 if not or if the sample is stale
+ */
+int pipeline_get(double *T, struct cpuload *l, struct sensorstats *ss) {
+	struct sample s;
+	struct timespec now;
+	
+	while(spsc_pop(&sq, &s)==0) { // the latest one wins
+		last=s;
+		samples++;
+		reads+=s.reads;
+	}
+	*T=last.T;
+	*l=last.cl;
+	*ss=last.ss;
+	clock_gettime(CLOCK_BOOTTIME, &now);
+	if(elapsedus(&last.t, &now)>SAMPLESTALEUS) { // a blocked read, or the thread is gone
+		if(stdlsf==0) {
+			tlog(LOG_ERR, "ERROR: No sample from the sensor thread for %.1f seconds!", elapsedus(&last.t, &now)/1e6);
+			stdlsf=1;
+		}
+		return 0;
+	}
+	stdlsf=0;
+	
+	return last.ok;
+}
+
+/**
+ * Wait up to su useconds for a new sample from the sensor thread. Return 1 if a new sample arrived, otherwise 0
+ */
+int pipeline_wait(useconds_t su) {
+	return spsc_wait(&sq, su);
+}
+
+/**
+ * Append sensor queue counters to the status report
+ */
+void pipeline_status(void) {
+	if(!srunning) return;
+	status_add("pipeline_sensor_depth", "%zu", spsc_depth(&sq));
+	status_add("pipeline_sensor_maxdepth", "%zu", atomic_load(&sq.maxdepth));
+	status_add("pipeline_sensor_pushes", "%lu", atomic_load(&sq.pushes));
+	status_add("pipeline_sensor_drops", "%lu", atomic_load(&sq.drops));
+	status_add("pipeline_oversampling", "%.1f", (samples>0) ? (double)reads/samples : 0);
+}
+
+/**
+ * Stop the sensor thread
+ */
+void pipeline_stop(void) {
+	if(!srunning) return;
+	sstop=1;
+	pthread_join(sthread, NULL);
+	srunning=0;
+	spsc_destroy(&sq);
+}
@@ -0,0 +1,82 @@
+/**
+ * Author: Dino Ciuffetti - dam2000 at gmail dot com
+ * Home: https://github.com/dam2k/fanChat
+ * Date: 2019-10-27
+ * Whatis: Melopero's FanHat Raspberry Pi FAN controller daemon rethinked from scratch and written in C
+ * Work with: Melopero FAN HAT for Raspberry Pi 4
+ *   https://www.melopero.com/shop/melopero-engineering/melopero-fan-hat-for-raspberry-pi-4/
+ * Requires: PiGpio library: http://abyz.me.uk/rpi/pigpio/ - apt update && apt install libpigpio-dev
+ * Replaces: official fan driver written in python: https://www.melopero.com/fan-hat/
+ * License: MIT License - https://opensource.org/licenses/MIT
+ *
+ * Notes:
+ * The Melopero FAN HAT for Raspberry Pi 4 is a cool (freddo!! :-)) fan driver for Raspberry Pi 4. It works using GPIO PIN 18 that
+ * has hardware driven PWM capabilities. This way they can handle fan speed changing the PIN's duty cycle.
+ * We continuously read the CPU temperature thanks to the /sys/class/thermal/thermal_zone0/temp file and we take care of cooling
+ * the CPU by setting up the right fan speed modulating the pin's PWM attached to the fan hat.
+ * Since I really hate when the fan is always on at low speed, I thinked of using a high and low watermarks.
+ * If the cpu's temperature is below the LW the fan will be shut down, and when the cpu's temperature raises above the HW the fan
+ * will come into play at the right speed. Also, there is a trigger timeout that will fire if the fan is down for more then a few
+ * minutes after the LW event. In this way we can cool down the RPI's temperature a little bit without reaching the HW or
+ * stressing us too much. Enjoy it!!
+ */
+
+/**
+ * Copyright 2019 Dino Ciuffetti - dam2000 at gmail dot com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+ * IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+struct cpuload;
+struct sensorstats;
+
+// the sensor thread reads the temperature this often (useconds), or just after each sensor update if its cadence is known...
+#define OVERSAMPLEUS 100000
+// ...and sends the average of its readings to the control thread this often (useconds)
+#define DECIMATEUS 1000000
+// no sample for this long (useconds): the sensor thread is stuck, don't trust the last temperature
+#define SAMPLESTALEUS (3*DECIMATEUS)
+
+/**
+ * Start the sensor thread, oversampling temperature and load and feeding the controller through a lock-free queue.
+ * Return -1 on errors or 0 on success
+ */
+int pipeline_start(void);
+
+/**
+ * Return 1 if the sensor thread is running
+ */
+int pipeline_running(void);
+
+/**
+ * Get the latest sample from the sensor thread storing temperature into T, load into l and the sensor counters into ss
+ * (unchanged if there's nothing new). Return 1 if the temperature can be trusted, 0 if not or if the sample is stale
+ */
+int pipeline_get(double *T, struct cpuload *l, struct sensorstats *ss);
+
+/**
+ * Wait up to su useconds for a new sample from the sensor thread. Return 1 if a new sample arrived, otherwise 0
+ */
+int pipeline_wait(useconds_t su);
+
+/**
+ * Append sensor queue counters to the status report
+ */
+void pipeline_status(void);
+
+/**
+ * Stop the sensor thread
+ */
+void pipeline_stop(void);
@@ -0,0 +1,283 @@
+/**
+ * Author: Dino Ciuffetti - dam2000 at gmail dot com
+ * Home: https://github.com/dam2k/fanChat
+ * Date: 2019-10-27
+ * Whatis: Melopero's FanHat Raspberry Pi FAN controller daemon rethinked from scratch and written in C
+ * Work with: Melopero FAN HAT for Raspberry Pi 4
+ *   https://www.melopero.com/shop/melopero-engineering/melopero-fan-hat-for-raspberry-pi-4/
+ * Requires: PiGpio library: http://abyz.me.uk/rpi/pigpio/ - apt update && apt install libpigpio-dev
+ * Replaces: official fan driver written in python: https://www.melopero.com/fan-hat/
+ * License: MIT License - https://opensource.org/licenses/MIT
+ *
+ * Notes:
+ * The Melopero FAN HAT for Raspberry Pi 4 is a cool (freddo!! :-)) fan driver for Raspberry Pi 4. It works using GPIO PIN 18 that
+ * has hardware driven PWM capabilities. This way they can handle fan speed changing the PIN's duty cycle.
+ * We continuously read the CPU temperature thanks to the /sys/class/thermal/thermal_zone0/temp file and we take care of cooling
+ * the CPU by setting up the right fan speed modulating the pin's PWM attached to the fan hat.
+ * Since I really hate when the fan is always on at low speed, I thinked of using a high and low watermarks.
+ * If the cpu's temperature is below the LW the fan will be shut down, and when the cpu's temperature raises above the HW the fan
+ * will come into play at the right speed. Also, there is a trigger timeout that will fire if the fan is down for more then a few
+ * minutes after the LW event. In this way we can cool down the RPI's temperature a little bit without reaching the HW or
+ * stressing us too much. Enjoy it!!
+ */
+
+/**
+ * Copyright 2019 Dino Ciuffetti - dam2000 at gmail dot com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+ * IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "common.h"
+#include <ctype.h>
+#include "policy.h"
+
+const struct policy policy_default = {
+	.LW=59.6,
+	.HW=69.4,
+	.max=79.4,
+	.TTT=273, // 4min + 33 secs
+	/*
+	  Fan speed steps. When the fan is ON its speed can be incremented by steps from 0 to 10, where step 0 is 42%, step 1 is 46%, and so on.
+	  Step 0 will be on LW, Step 10 will be on max, btw the fan will be ALWAYS ON ONLY IF the temperature exceeds HW, eventually the Trigger timeout
+	  will fire if temperature stands between LW and HW. Under LW the fan will be off.
+	*/
+	//         STEPS:    0   1   2   3   4   5   6   7   8   9   10
+	.steps={42, 46, 52, 57, 61, 66, 72, 80, 88, 94, 100}, // %
+	.sampling=1.0,
+	.minon=60,
+	.minoff=30,
+	.budget=600 // e.g. 2 C above LW for 5 minutes
+};
+
+/*
+  Load feedforward. Temperature lags CPU load by seconds to tens of seconds, so when the sustained load exceeds LFT the fan is
+  spun up in advance (up to step LFMAXSTEP at full load), on top of the temperature policy. Sustained load drops quickly when the
+  load stops, giving the fan back to the temperature policy. Under LFMINTEMP there is plenty of headroom and load is ignored.
+*/
+// Load Feedforward Threshold: sustained load (0..1) above this one spins up the fan
+static const double LFT=0.6;
+// Load Feedforward Min Temperature: under this temperature the load feedforward is off
+static const double LFMINTEMP=55.0;
+// Load Feedforward Max Step: the highest fan speed step the load feedforward can ask for
+static const int LFMAXSTEP=5;
+
+/**
+ * Load the policy from the config file path, on top of the values already in pol. Return -1 on errors or 0 on success
+ */
+int policy_load(const char *path, struct policy *pol) {
+	FILE *f;
+	char line[256], *k, *v, *e;
+	struct policy p=*pol;
+	int n=0, i, ret=0;
+	
+	f=fopen(path, "r");
+	if(f==NULL) {
+		fprintf(stderr, "Cannot open policy %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	while(ret==0 && fgets(line, sizeof(line), f)!=NULL) {
+		n++;
+		line[strcspn(line, "#\n")]='\0';
+		for(k=line; isspace((unsigned char)*k); k++);
+		if(*k=='\0') continue;
+		v=strchr(k, '=');
+		if(v==NULL) {
+			ret=-1;
+			break;
+		}
+		for(e=v; e>k && isspace((unsigned char)e[-1]); e--);
+		*e='\0';
+		v++;
+		errno=0;
+		if(strcmp(k, "lw")==0) {
+			p.LW=strtod(v, &e);
+		} else if(strcmp(k, "hw")==0) {
+			p.HW=strtod(v, &e);
+		} else if(strcmp(k, "max")==0) {
+			p.max=strtod(v, &e);
+		} else if(strcmp(k, "ttt")==0) {
+			p.TTT=strtol(v, &e, 10);
+		} else if(strcmp(k, "sampling")==0) {
+			p.sampling=strtod(v, &e);
+		} else if(strcmp(k, "minon")==0) {
+			p.minon=strtod(v, &e);
+		} else if(strcmp(k, "minoff")==0) {
+			p.minoff=strtod(v, &e);
+		} else if(strcmp(k, "budget")==0) {
+			p.budget=strtod(v, &e);
+		} else if(strcmp(k, "steps")==0) {
+			e=v;
+			for(i=0; i<POLICYSTEPS; i++) {
+				if(i>0 && *e++!=',') break;
+				p.steps[i]=strtol(e, &e, 10);
+			}
+			if(i<POLICYSTEPS) ret=-1;
+		} else {
+			ret=-1;
+		}
+		while(isspace((unsigned char)*e)) e++;
+		if(*e!='\0' || errno!=0) ret=-1;
+	}
+	fclose(f);
+	if(ret<0) {
+		fprintf(stderr, "Invalid policy %s at line %d\n", path, n);
+		return -1;
+	}
+	if(policy_check(&p)<0) {
+		fprintf(stderr, "Invalid policy %s: watermarks, steps or sampling out of range\n", path);
+		return -1;
+	}
+	*pol=p;
+	
+	return 0;
+}
+
+/**
+ * Write the policy in the config file format
+ */
+void policy_write(FILE *f, const struct policy *pol) {
+	int i;
+	
+	fprintf(f, "lw=%.1f\nhw=%.1f\nmax=%.1f\nttt=%ld\nsteps=", pol->LW, pol->HW, pol->max, (long)pol->TTT);
+	for(i=0; i<POLICYSTEPS; i++) {
+		fprintf(f, (i>0) ? ",%d" : "%d", pol->steps[i]);
+	}
+	fprintf(f, "\nsampling=%.2f\nminon=%.0f\nminoff=%.0f\nbudget=%.0f\n", pol->sampling, pol->minon, pol->minoff, pol->budget);
+}
+
+/**
+ * Return -1 if the policy doesn't make sense or 0 if it's fine
+ */
+int policy_check(const struct policy *pol) {
+	int i;
+	
+	if(!(pol->LW<pol->HW && pol->HW<pol->max) || pol->TTT<=0) return -1;
+	if(!(pol->sampling>=0.1 && pol->sampling<=10)) return -1;
+	if(!(pol->minon>=0 && pol->minoff>=0 && pol->budget>=0)) return -1;
+	for(i=0; i<POLICYSTEPS; i++) {
+		if(pol->steps[i]<0 || pol->steps[i]>100 || (i>0 && pol->steps[i]<pol->steps[i-1])) return -1;
+	}
+	
+	return 0;
+}
+
+/**
+ * calculate fan speed by the temperature. Return percentage chose
+ */
+int policy_speedbytemp(const struct policy *pol, double T) {
+	int i;
+	double tsbase, ts;
+	
+	tsbase=(pol->max-pol->LW)/10;
+	for(i=10; i>=0; i--) { // find the fan speed (from step 10 to 0)
+		ts=(pol->LW+(tsbase*i));
+		if(T>ts) { // temperature exceed step i, returning proper fan speed
+			//syslog(LOG_INFO, "Temp: %2.1f C > %2.1f (step %i (0/10)), fan set at %i%%\n", T, ts, i, pol->steps[i]);
+			return pol->steps[i];
+		}
+	}
+	
+	//syslog(LOG_INFO, "Temp (%2.1f C) is under %2.1f, fan not needed at the moment\n", T, pol->LW);
+	return 0;
+}
+
+/**
+ * calculate fan speed asked by the load feedforward. Return percentage chose, 0 if the load doesn't require the fan
+ */
+int policy_speedbyload(const struct policy *pol, double T, double L) {
+	int i;
+	
+	if(T<LFMINTEMP || L<=LFT) {
+		return 0;
+	}
+	i=(int)((L-LFT)/(1-LFT)*LFMAXSTEP+0.5);
+	if(i>LFMAXSTEP) i=LFMAXSTEP;
+	
+	return pol->steps[i];
+}
+
+/**
+ * Apply the dwell times and the temperature budget to the fan speed p% wanted at time t (seconds) with temperature T.
+ * urgent: no waiting. Return the fan speed to set
+ */
+int policy_dwell(const struct policy *pol, struct dwell *d, double T, double t, int p, int urgent) {
+	double dt;
+	
+	dt=(d->last>0) ? t-d->last : 0;
+	d->last=t;
+	if(!d->on) {
+		d->integral+=(T-pol->LW)*dt; // below LW it pays the warmth back
+		if(d->integral<0) d->integral=0;
+		if(p>0 && !urgent) {
+			if(t-d->since<pol->minoff || d->integral<pol->budget) { // rest a bit more, it's just warm
+				p=0;
+			} else if(pol->budget>0) { // start slow: a long run at low speed instead of a short burst
+				d->slow=1;
+			}
+		}
+	}
+	if(urgent || T>=pol->HW) d->slow=0;
+	if(p>0 && d->slow) p=pol->steps[0];
+	if(d->on && p<d->p && t-d->changed<pol->minon) { // don't slow down or stop yet
+		p=d->p;
+	}
+	policy_dwellset(d, t, p);
+	
+	return p;
+}
+
+/**
+ * Record in the dwell state the fan speed p% set at time t (seconds), whoever chose it: the dwell times run from the speed the
+ * fan really has, after failing safe or a sequence too
+ */
+void policy_dwellset(struct dwell *d, double t, int p) {
+	if(p!=d->p) {
+		d->p=p;
+		d->changed=t;
+	}
+	if((p>0)!=d->on) {
+		d->on=(p>0);
+		d->since=t;
+		d->integral=0;
+		if(!d->on) d->slow=0;
+	}
+}
+
+/**
+ * calculate usleep time depending on temperature. Higher temperatures require slower readings. Return useconds to sleep
+ */
+useconds_t policy_sleep(const struct policy *pol, double T) {
+	useconds_t su=750000; // default is 0.75 seconds
+	
+	if(T>50.2) {
+		su=1000000;
+	}
+	if(T>62.5) {
+		su=1500000;
+	}
+	if(T>65.1) {
+		su=2000000;
+	}
+	if(T>70.6) {
+		su=3000000;
+	}
+	if(T>75.3) {
+		su=4000000;
+	}
+	if(T>77.6) {
+		su=5000000;
+	}
+	
+	return (useconds_t)(su*pol->sampling);
+}
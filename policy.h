@@ -0,0 +1,125 @@
+/**
+ * Author: Dino Ciuffetti - dam2000 at gmail dot com
+ * Home: https://github.com/dam2k/fanChat
+ * Date: 2019-10-27
+ * Whatis: Melopero's FanHat Raspberry Pi FAN controller daemon rethinked from scratch and written in C
+ * Work with: Melopero FAN HAT for Raspberry Pi 4
+ *   https://www.melopero.com/shop/melopero-engineering/melopero-fan-hat-for-raspberry-pi-4/
+ * Requires: PiGpio library: http://abyz.me.uk/rpi/pigpio/ - apt update && apt install libpigpio-dev
+ * Replaces: official fan driver written in python: https://www.melopero.com/fan-hat/
+ * License: MIT License - https://opensource.org/licenses/MIT
+ *
+ * Notes:
+ * The Melopero FAN HAT for Raspberry Pi 4 is a cool (freddo!! :-)) fan driver for Raspberry Pi 4. It works using GPIO PIN 18 that
+ * has hardware driven PWM capabilities. This way they can handle fan speed changing the PIN's duty cycle.
+ * We continuously read the CPU temperature thanks to the /sys/class/thermal/thermal_zone0/temp file and we take care of cooling
+ * the CPU by setting up the right fan speed modulating the pin's PWM attached to the fan hat.
+ * Since I really hate when the fan is always on at low speed, I thinked of using a high and low watermarks.
+ * If the cpu's temperature is below the LW the fan will be shut down, and when the cpu's temperature raises above the HW the fan
+ * will come into play at the right speed. Also, there is a trigger timeout that will fire if the fan is down for more then a few
+ * minutes after the LW event. In this way we can cool down the RPI's temperature a little bit without reaching the HW or
+ * stressing us too much. Enjoy it!!
+ */
+
+/**
+ * Copyright 2019 Dino Ciuffetti - dam2000 at gmail dot com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+ * IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <sys/types.h>
+
+/*
+  The temperature policy: the watermarks, the trigger timeout, the fan speed curve, the dwell times and how often the temperature
+  is sampled.
+  The defaults were tuned by hand on one board, fanChat-tune searches better ones on recorded traces and writes them as config
+  files (key=value lines) that fanChat loads with -C.
+*/
+#define POLICYSTEPS 11
+
+struct policy {
+	double LW; // Low Watermark: at this temperature the fan will be off
+	double HW; // High Watermark: at this temperature the fan will be on
+	double max; // Max fan speed will be reached when temperature rise above this one
+	time_t TTT; // Trigger Timeout (seconds): after this time from Last Watermark the fan will be on (if temperature is above low watermark)
+	int steps[POLICYSTEPS]; // fan speed steps (%), step 0 on LW, step 10 on max
+	double sampling; // the temperature sampling intervals are multiplied by this factor
+	double minon; // the fan runs at least this long at a speed before slowing down or stopping (seconds)
+	double minoff; // once stopped the fan rests at least this long (seconds), unless it's urgent
+	double budget; // with the fan off, how much warmth above LW (C*s) is fine before the trigger timeout may start it
+};
+
+/*
+  Dwell scheduler: every fan start costs inrush current, noise and bearing wear, and a short burst buys little cooling. Between
+  the watermarks the fan starts only once it rested minoff and the temperature integral above LW spent the budget, and then it
+  runs for longer at the lowest speed rather than briefly at a higher one. The integral is signed: a spell below LW pays back the
+  warmth before it, so hovering around LW doesn't start the fan, while dipping below LW for a moment doesn't reset the budget.
+  A speed is kept at least minon before slowing down or stopping. Above HW, on load feedforward, on a stuck fan or failing safe
+  there is no waiting to spin up.
+*/
+struct dwell {
+	int on; // fan running
+	int slow; // started between the watermarks: running at the lowest speed
+	int p; // fan speed (%)
+	double since; // when it started or stopped (seconds)
+	double changed; // when the fan speed changed (seconds)
+	double integral; // temperature integral above LW since the fan stopped, paid back below LW (C*s)
+	double last; // last round (seconds)
+};
+
+// the hand tuned policy
+extern const struct policy policy_default;
+
+/**
+ * Load the policy from the config file path, on top of the values already in pol. Return -1 on errors or 0 on success
+ */
+int policy_load(const char *path, struct policy *pol);
+
+/**
+ * Write the policy in the config file format
+ */
+void policy_write(FILE *f, const struct policy *pol);
+
+/**
+ * Return -1 if the policy doesn't make sense or 0 if it's fine
+ */
+int policy_check(const struct policy *pol);
+
+/**
+ * calculate fan speed by the temperature. Return percentage chose
+ */
+int policy_speedbytemp(const struct policy *pol, double T);
+
+/**
+ * calculate fan speed asked by the load feedforward. Return percentage chose, 0 if the load doesn't require the fan
+ */
+int policy_speedbyload(const struct policy *pol, double T, double L);
+
+/**
+ * Apply the dwell times and the temperature budget to the fan speed p% wanted at time t (seconds) with temperature T.
+ * urgent: no waiting. Return the fan speed to set
+ */
+int policy_dwell(const struct policy *pol, struct dwell *d, double T, double t, int p, int urgent);
+
+/**
+ * Record in the dwell state the fan speed p% set at time t (seconds), whoever chose it: the dwell times run from the speed the
+ * fan really has, after failing safe or a sequence too
+ */
+void policy_dwellset(struct dwell *d, double t, int p);
+
+/**
+ * calculate usleep time depending on temperature. Higher temperatures require slower readings. Return useconds to sleep
+ */
+useconds_t policy_sleep(const struct policy *pol, double T);
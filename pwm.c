@@ -0,0 +1,226 @@
+/**
+ * Author: Dino Ciuffetti - dam2000 at gmail dot com
+ * Home: https://github.com/dam2k/fanChat
+ * Date: 2019-10-27
+ * Whatis: Melopero's FanHat Raspberry Pi FAN controller daemon rethinked from scratch and written in C
+ * Work with: Melopero FAN HAT for Raspberry Pi 4
+ *   https://www.melopero.com/shop/melopero-engineering/melopero-fan-hat-for-raspberry-pi-4/
+ * Requires: PiGpio library: http://abyz.me.uk/rpi/pigpio/ - apt update && apt install libpigpio-dev
+ * Replaces: official fan driver written in python: https://www.melopero.com/fan-hat/
+ * License: MIT License - https://opensource.org/licenses/MIT
+ *
+ * Notes:
+ * The Melopero FAN HAT for Raspberry Pi 4 is a cool (freddo!! :-)) fan driver for Raspberry Pi 4. It works using GPIO PIN 18 that
+ * has hardware driven PWM capabilities. This way they can handle fan speed changing the PIN's duty cycle.
+ * We continuously read the CPU temperature thanks to the /sys/class/thermal/thermal_zone0/temp file and we take care of cooling
+ * the CPU by setting up the right fan speed modulating the pin's PWM attached to the fan hat.
+ * Since I really hate when the fan is always on at low speed, I thinked of using a high and low watermarks.
+ * If the cpu's temperature is below the LW the fan will be shut down, and when the cpu's temperature raises above the HW the fan
+ * will come into play at the right speed. Also, there is a trigger timeout that will fire if the fan is down for more then a few
+ * minutes after the LW event. In this way we can cool down the RPI's temperature a little bit without reaching the HW or
+ * stressing us too much. Enjoy it!!
+ */
+
+/**
+ * Copyright 2019 Dino Ciuffetti - dam2000 at gmail dot com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+ * IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "common.h"
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "sysfs.h"
+#include "pwm.h"
+
+// where the SoC peripherals are, read from the device tree (cells: bus address, CPU address, size)
+#define SOCRANGESFILE "/proc/device-tree/soc/ranges"
+#define PERIBASEDEFAULT 0x3F000000 // Pi 2 and 3
+#define PERIBASEPI4 0xFE000000
+// register blocks offsets from the peripheral base
+#define GPIOOFFSET 0x200000
+#define PWMOFFSET 0x20C000
+#define CMOFFSET 0x101000
+#define BLOCKSIZE 4096
+// clock manager oscillator (Hz)
+#define OSCFREQ 19200000
+#define OSCFREQPI4 54000000
+
+// GPIO registers (32 bit words)
+#define GPFSEL1 (0x04/4)
+#define GPCLR0 (0x28/4)
+#define GPIOPIN 18
+#define GPIOFSEL_OUT 1
+#define GPIOFSEL_ALT5 2
+// PWM registers
+#define PWMCTL (0x00/4)
+#define PWMRNG1 (0x10/4)
+#define PWMDAT1 (0x14/4)
+#define PWMCTL_PWEN1 0x01
+#define PWMCTL_MSEN1 0x80 // mark-space: a plain duty cycle
+// clock manager registers
+#define CMPWMCTL (0xA0/4)
+#define CMPWMDIV (0xA4/4)
+#define CMPASSWD 0x5A000000
+#define CMCTL_SRC_OSC 1
+#define CMCTL_ENAB 0x10
+#define CMCTL_BUSY 0x80
+// how long to wait for the clock to stop (usecs)
+#define CMBUSYUS 10000
+
+static volatile uint32_t *gpio=NULL, *pwm=NULL, *cm=NULL;
+static void *mock=MAP_FAILED;
+
+// 4 big endian bytes at offset off of b, a device tree cell
+static uint32_t dtcell(const unsigned char *b, int off) {
+	return (uint32_t)b[off]<<24 | b[off+1]<<16 | b[off+2]<<8 | b[off+3];
+}
+
+// the SoC peripherals base address
+static uint32_t peribase(void) {
+	unsigned char b[16];
+	uint32_t base=0;
+	int fd;
+	ssize_t r;
+	
+	fd=sysfs_open(SOCRANGESFILE, O_RDONLY);
+	if(fd>=0) {
+		r=pread(fd, b, sizeof(b), 0);
+		close(fd);
+		if(r>=12) base=dtcell(b, 4);
+		if(base==0 && r>=16) base=dtcell(b, 8); // Pi 4: 64 bit CPU address
+	}
+	
+	return (base!=0) ? base : PERIBASEDEFAULT;
+}
+
+static volatile uint32_t *mapblock(int fd, off_t off) {
+	void *p;
+	
+	p=mmap(NULL, BLOCKSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, off);
+	return (p==MAP_FAILED) ? NULL : p;
+}
+
+// GPIO18 function
+static void gpiofsel(uint32_t f) {
+	int shift=(GPIOPIN%10)*3;
+	
+	gpio[GPFSEL1]=(gpio[GPFSEL1] & ~(7u<<shift)) | f<<shift;
+}
+
+// PWM clock from the oscillator at osc Hz
+static void pwmclock(uint32_t osc) {
+	struct timespec t={0, 10000};
+	uint32_t div;
+	int i;
+	
+	div=osc/(PWMFREQ*PWMRANGE);
+	if(div<2) div=2;
+	if(div>4095) div=4095;
+	cm[CMPWMCTL]=CMPASSWD | (cm[CMPWMCTL] & ~CMCTL_ENAB & 0xFFFFFF); // stop it, then wait: changing a running clock glitches
+	for(i=0; i<CMBUSYUS/10 && (cm[CMPWMCTL] & CMCTL_BUSY); i++) {
+		nanosleep(&t, NULL);
+	}
+	cm[CMPWMDIV]=CMPASSWD | div<<12;
+	cm[CMPWMCTL]=CMPASSWD | CMCTL_SRC_OSC;
+	cm[CMPWMCTL]=CMPASSWD | CMCTL_SRC_OSC | CMCTL_ENAB;
+}
+
+/**
+ * Map the registers from device and setup GPIO18 as hardware PWM, output low. Return -1 on errors or 0 on success
+ */
+int pwm_open(const char *device) {
+	struct stat st;
+	uint32_t base, osc;
+	int fd;
+	
+	fd=open(device, O_RDWR | O_SYNC | O_CLOEXEC);
+	if(fd<0) {
+		fprintf(stderr, "Cannot open %s: %s\n", device, strerror(errno));
+		return -1;
+	}
+	if(fstat(fd, &st)==0 && S_ISREG(st.st_mode)) { // mock register file: GPIO, PWM and clock manager pages
+		if(st.st_size<3*BLOCKSIZE && ftruncate(fd, 3*BLOCKSIZE)<0) {
+			fprintf(stderr, "Cannot size mock register file %s: %s\n", device, strerror(errno));
+			close(fd);
+			return -1;
+		}
+		mock=mmap(NULL, 3*BLOCKSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if(mock!=MAP_FAILED) {
+			gpio=mock;
+			pwm=gpio+BLOCKSIZE/4;
+			cm=pwm+BLOCKSIZE/4;
+		}
+		osc=OSCFREQ;
+	} else {
+		base=peribase();
+		gpio=mapblock(fd, base+GPIOOFFSET);
+		pwm=mapblock(fd, base+PWMOFFSET);
+		cm=mapblock(fd, base+CMOFFSET);
+		osc=(base==PERIBASEPI4) ? OSCFREQPI4 : OSCFREQ;
+	}
+	close(fd); // the mappings stay
+	if(gpio==NULL || pwm==NULL || cm==NULL) {
+		fprintf(stderr, "Cannot map the PWM registers from %s: %s\n", device, strerror(errno));
+		pwm_close();
+		return -1;
+	}
+	
+	pwm[PWMCTL]=0; // stop the channel while the clock changes
+	pwmclock(osc);
+	pwm[PWMRNG1]=PWMRANGE;
+	pwm[PWMDAT1]=0;
+	pwm[PWMCTL]=PWMCTL_MSEN1 | PWMCTL_PWEN1;
+	gpiofsel(GPIOFSEL_ALT5);
+	
+	return 0;
+}
+
+/**
+ * Set the duty cycle to p%
+ */
+void pwm_set(unsigned int p) {
+	if(pwm==NULL) return;
+	if(p>100) p=100;
+	pwm[PWMDAT1]=p*PWMRANGE/100;
+}
+
+/**
+ * Stop the PWM, leave GPIO18 as output low and unmap the registers
+ */
+void pwm_close(void) {
+	if(gpio!=NULL && pwm!=NULL) {
+		pwm[PWMDAT1]=0;
+		pwm[PWMCTL]=0;
+		gpio[GPCLR0]=1u<<GPIOPIN;
+		gpiofsel(GPIOFSEL_OUT);
+	}
+	pwm_release();
+}
+
+/**
+ * Unmap the registers, leaving GPIO18 and the PWM running at their duty cycle
+ */
+void pwm_release(void) {
+	if(mock!=MAP_FAILED) {
+		munmap(mock, 3*BLOCKSIZE);
+		mock=MAP_FAILED;
+	} else {
+		if(gpio!=NULL) munmap((void *)gpio, BLOCKSIZE);
+		if(pwm!=NULL) munmap((void *)pwm, BLOCKSIZE);
+		if(cm!=NULL) munmap((void *)cm, BLOCKSIZE);
+	}
+	gpio=pwm=cm=NULL;
+}
@@ -0,0 +1,168 @@
+/**
+ * Author: Dino Ciuffetti - dam2000 at gmail dot com
+ * Home: https://github.com/dam2k/fanChat
+ * Date: 2019-10-27
+ * Whatis: Melopero's FanHat Raspberry Pi FAN controller daemon rethinked from scratch and written in C
+ * Work with: Melopero FAN HAT for Raspberry Pi 4
+ *   https://www.melopero.com/shop/melopero-engineering/melopero-fan-hat-for-raspberry-pi-4/
+ * Requires: PiGpio library: http://abyz.me.uk/rpi/pigpio/ - apt update && apt install libpigpio-dev
+ * Replaces: official fan driver written in python: https://www.melopero.com/fan-hat/
+ * License: MIT License - https://opensource.org/licenses/MIT
+ *
+ * Notes:
+ * The Melopero FAN HAT for Raspberry Pi 4 is a cool (freddo!! :-)) fan driver for Raspberry Pi 4. It works using GPIO PIN 18 that
+ * has hardware driven PWM capabilities. This way they can handle fan speed changing the PIN's duty cycle.
+ * We continuously read the CPU temperature thanks to the /sys/class/thermal/thermal_zone0/temp file and we take care of cooling
+ * the CPU by setting up the right fan speed modulating the pin's PWM attached to the fan hat.
+ * Since I really hate when the fan is always on at low speed, I thinked of using a high and low watermarks.
+ * If the cpu's temperature is below the LW the fan will be shut down, and when the cpu's temperature raises above the HW the fan
+ * will come into play at the right speed. Also, there is a trigger timeout that will fire if the fan is down for more then a few
+ * minutes after the LW event. In this way we can cool down the RPI's temperature a little bit without reaching the HW or
+ * stressing us too much. Enjoy it!!
+ */
+
+/**
+ * Copyright 2019 Dino Ciuffetti - dam2000 at gmail dot com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+ * IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "common.h"
+#include <time.h>
+#include "seq.h"
+
+// ramps change the fan speed this often (ms)
+#define SEQRAMPTICKMS 100
+// kick-start pulse: fan off for this long (ms), then full speed for this long (ms)
+#define SEQKICKOFFMS 830
+#define SEQKICKONMS 1000
+
+static struct seqprog cur; // running program
+static int running=0;
+static int step; // running step
+static int from; // fan speed when the step started
+static long long tstep; // when the step started (ms)
+
+static long long nowms(void) {
+	struct timespec t;
+	
+	clock_gettime(CLOCK_BOOTTIME, &t);
+	return t.tv_sec*1000LL+t.tv_nsec/1000000;
+}
+
+/**
+ * Start the program prog with the fan currently at p%. Return -1 if a sequence with higher priority is running, otherwise 0
+ */
+int seq_start(const struct seqprog *prog, int p) {
+	if(running && cur.prio>prog->prio) return -1;
+	cur=*prog;
+	running=1;
+	step=0;
+	from=p;
+	tstep=nowms();
+	
+	return 0;
+}
+
+/**
+ * Kick-start pulse: fan off for a while then full speed, to unlock a stuck fan. Return -1 if preempted
+ */
+int seq_kick(int p) {
+	static const struct seqprog kick = { "kick-start", SEQPRIO_KICK, 2, { { 0, 0, SEQKICKOFFMS }, { 100, 0, SEQKICKONMS } } };
+	
+	return seq_start(&kick, p);
+}
+
+/**
+ * Fan at full speed for secs seconds. Return -1 if preempted
+ */
+int seq_boost(int p, unsigned int secs) {
+	struct seqprog boost = { "boost", SEQPRIO_BOOST, 1, { { 100, 0, secs*1000 } } };
+	
+	return seq_start(&boost, p);
+}
+
+/**
+ * Soft stop: linear ramp from p% to 0 in ms milliseconds. Return -1 if preempted
+ */
+int seq_softstop(int p, unsigned int ms) {
+	struct seqprog stop = { "soft stop", SEQPRIO_STOP, 1, { { 0, ms, 0 } } };
+	
+	return seq_start(&stop, p);
+}
+
+/**
+ * If a sequence is running store into p the fan speed it wants now and into su the useconds until its next change.
+ * Return 1 if a sequence is running, otherwise 0
+ */
+int seq_run(int *p, useconds_t *su) {
+	long long t, el, left;
+	struct seqstep *s;
+	
+	if(!running) return 0;
+	t=nowms();
+	// skip the steps already done
+	while(step<cur.nsteps && (el=t-tstep)>=(long long)cur.steps[step].ramp+cur.steps[step].hold) {
+		from=cur.steps[step].p;
+		tstep+=cur.steps[step].ramp+cur.steps[step].hold;
+		step++;
+	}
+	if(step==cur.nsteps) {
+		running=0;
+		return 0;
+	}
+	s=&cur.steps[step];
+	el=t-tstep;
+	if(el<s->ramp) { // ramping
+		*p=from+(s->p-from)*el/(long long)s->ramp;
+		left=s->ramp-el;
+		if(left>SEQRAMPTICKMS) left=SEQRAMPTICKMS;
+	} else { // holding
+		*p=s->p;
+		left=s->ramp+s->hold-el;
+	}
+	*su=left*1000;
+	
+	return 1;
+}
+
+/**
+ * Return the name of the running sequence, NULL if none
+ */
+const char *seq_name(void) {
+	return running ? cur.name : NULL;
+}
+
+/**
+ * Return the priority of the running sequence, 0 if none
+ */
+int seq_prio(void) {
+	return running ? cur.prio : 0;
+}
+
+/**
+ * Return the milliseconds left to the end of the running sequence, 0 if none
+ */
+long long seq_left(void) {
+	long long end;
+	int i;
+	
+	if(!running) return 0;
+	end=tstep;
+	for(i=step; i<cur.nsteps; i++) {
+		end+=cur.steps[i].ramp+cur.steps[i].hold;
+	}
+	end-=nowms();
+	
+	return (end>0) ? end : 0;
+}
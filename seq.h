@@ -0,0 +1,107 @@
+/**
+ * Author: Dino Ciuffetti - dam2000 at gmail dot com
+ * Home: https://github.com/dam2k/fanChat
+ * Date: 2019-10-27
+ * Whatis: Melopero's FanHat Raspberry Pi FAN controller daemon rethinked from scratch and written in C
+ * Work with: Melopero FAN HAT for Raspberry Pi 4
+ *   https://www.melopero.com/shop/melopero-engineering/melopero-fan-hat-for-raspberry-pi-4/
+ * Requires: PiGpio library: http://abyz.me.uk/rpi/pigpio/ - apt update && apt install libpigpio-dev
+ * Replaces: official fan driver written in python: https://www.melopero.com/fan-hat/
+ * License: MIT License - https://opensource.org/licenses/MIT
+ *
+ * Notes:
+ * The Melopero FAN HAT for Raspberry Pi 4 is a cool (freddo!! :-)) fan driver for Raspberry Pi 4. It works using GPIO PIN 18 that
+ * has hardware driven PWM capabilities. This way they can handle fan speed changing the PIN's duty cycle.
+ * We continuously read the CPU temperature thanks to the /sys/class/thermal/thermal_zone0/temp file and we take care of cooling
+ * the CPU by setting up the right fan speed modulating the pin's PWM attached to the fan hat.
+ * Since I really hate when the fan is always on at low speed, I thinked of using a high and low watermarks.
+ * If the cpu's temperature is below the LW the fan will be shut down, and when the cpu's temperature raises above the HW the fan
+ * will come into play at the right speed. Also, there is a trigger timeout that will fire if the fan is down for more then a few
+ * minutes after the LW event. In this way we can cool down the RPI's temperature a little bit without reaching the HW or
+ * stressing us too much. Enjoy it!!
+ */
+
+/**
+ * Copyright 2019 Dino Ciuffetti - dam2000 at gmail dot com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+ * IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+/*
+  Sequence engine: timed actuator programs (kick-start pulse, boost, soft stop) run by the controller without blocking.
+  While a sequence runs it owns the fan, and the controller keeps sensing and logging. A sequence can be preempted only by one
+  with the same or higher priority.
+*/
+#define SEQMAXSTEPS 4
+
+// sequence priorities
+#define SEQPRIO_BOOST 2
+#define SEQPRIO_KICK 3
+#define SEQPRIO_STOP 4
+
+// a sequence step: ramp the fan linearly from the current speed to p% in ramp ms (0: jump), then hold it for hold ms
+struct seqstep {
+	int p;
+	unsigned int ramp;
+	unsigned int hold;
+};
+
+struct seqprog {
+	const char *name;
+	int prio;
+	int nsteps;
+	struct seqstep steps[SEQMAXSTEPS];
+};
+
+/**
+ * Start the program prog with the fan currently at p%. Return -1 if a sequence with higher priority is running, otherwise 0
+ */
+int seq_start(const struct seqprog *prog, int p);
+
+/**
+ * Kick-start pulse: fan off for a while then full speed, to unlock a stuck fan. Return -1 if preempted
+ */
+int seq_kick(int p);
+
+/**
+ * Fan at full speed for secs seconds. Return -1 if preempted
+ */
+int seq_boost(int p, unsigned int secs);
+
+/**
+ * Soft stop: linear ramp from p% to 0 in ms milliseconds. Return -1 if preempted
+ */
+int seq_softstop(int p, unsigned int ms);
+
+/**
+ * If a sequence is running store into p the fan speed it wants now and into su the useconds until its next change.
+ * Return 1 if a sequence is running, otherwise 0
+ */
+int seq_run(int *p, useconds_t *su);
+
+/**
+ * Return the name of the running sequence, NULL if none
+ */
+const char *seq_name(void);
+
+/**
+ * Return the priority of the running sequence, 0 if none
+ */
+int seq_prio(void);
+
+/**
+ * Return the milliseconds left to the end of the running sequence, 0 if none
+ */
+long long seq_left(void);
@@ -0,0 +1,137 @@
+/**
+ * Author: Dino Ciuffetti - dam2000 at gmail dot com
+ * Home: https://github.com/dam2k/fanChat
+ * Date: 2019-10-27
+ * Whatis: Melopero's FanHat Raspberry Pi FAN controller daemon rethinked from scratch and written in C
+ * Work with: Melopero FAN HAT for Raspberry Pi 4
+ *   https://www.melopero.com/shop/melopero-engineering/melopero-fan-hat-for-raspberry-pi-4/
+ * Requires: PiGpio library: http://abyz.me.uk/rpi/pigpio/ - apt update && apt install libpigpio-dev
+ * Replaces: official fan driver written in python: https://www.melopero.com/fan-hat/
+ * License: MIT License - https://opensource.org/licenses/MIT
+ *
+ * Notes:
+ * The Melopero FAN HAT for Raspberry Pi 4 is a cool (freddo!! :-)) fan driver for Raspberry Pi 4. It works using GPIO PIN 18 that
+ * has hardware driven PWM capabilities. This way they can handle fan speed changing the PIN's duty cycle.
+ * We continuously read the CPU temperature thanks to the /sys/class/thermal/thermal_zone0/temp file and we take care of cooling
+ * the CPU by setting up the right fan speed modulating the pin's PWM attached to the fan hat.
+ * Since I really hate when the fan is always on at low speed, I thinked of using a high and low watermarks.
+ * If the cpu's temperature is below the LW the fan will be shut down, and when the cpu's temperature raises above the HW the fan
+ * will come into play at the right speed. Also, there is a trigger timeout that will fire if the fan is down for more then a few
+ * minutes after the LW event. In this way we can cool down the RPI's temperature a little bit without reaching the HW or
+ * stressing us too much. Enjoy it!!
+ */
+
+/**
+ * Copyright 2019 Dino Ciuffetti - dam2000 at gmail dot com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+ * IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "common.h"
+#include <poll.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include "spsc.h"
+
+/**
+ * Setup the ring q over buf (size slots of elemsize bytes). Return -1 on errors or 0 on success
+ */
+int spsc_init(struct spsc *q, void *buf, size_t size, size_t elemsize) {
+	if(size==0 || (size & (size-1))!=0) return -1;
+	q->buf=buf;
+	q->size=size;
+	q->elemsize=elemsize;
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+	atomic_init(&q->pushes, 0);
+	atomic_init(&q->drops, 0);
+	atomic_init(&q->maxdepth, 0);
+	q->efd=eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	
+	return (q->efd<0) ? -1 : 0;
+}
+
+/**
+ * Push a copy of e and wake up the consumer (producer side). Return -1 if the ring is full (e is dropped) or 0 on success
+ */
+int spsc_push(struct spsc *q, const void *e) {
+	size_t h, t;
+	uint64_t one=1;
+	
+	h=atomic_load_explicit(&q->head, memory_order_relaxed);
+	t=atomic_load_explicit(&q->tail, memory_order_acquire);
+	if(h-t>=q->size) {
+		atomic_fetch_add_explicit(&q->drops, 1, memory_order_relaxed);
+		return -1;
+	}
+	memcpy(q->buf+(h & (q->size-1))*q->elemsize, e, q->elemsize);
+	atomic_store_explicit(&q->head, h+1, memory_order_release);
+	atomic_fetch_add_explicit(&q->pushes, 1, memory_order_relaxed);
+	if(h+1-t>atomic_load_explicit(&q->maxdepth, memory_order_relaxed)) {
+		atomic_store_explicit(&q->maxdepth, h+1-t, memory_order_relaxed);
+	}
+	if(write(q->efd, &one, sizeof(one))<0) {
+		// the counter is saturated, the consumer is awake anyway
+	}
+	
+	return 0;
+}
+
+/**
+ * Pop the oldest element into e (consumer side). Return -1 if the ring is empty or 0 on success
+ */
+int spsc_pop(struct spsc *q, void *e) {
+	size_t h, t;
+	
+	t=atomic_load_explicit(&q->tail, memory_order_relaxed);
+	h=atomic_load_explicit(&q->head, memory_order_acquire);
+	if(h==t) return -1;
+	memcpy(e, q->buf+(t & (q->size-1))*q->elemsize, q->elemsize);
+	atomic_store_explicit(&q->tail, t+1, memory_order_release);
+	
+	return 0;
+}
+
+/**
+ * Wait up to timeout useconds for the producer to push something (consumer side). Return 1 if woken up by a push, otherwise 0
+ */
+int spsc_wait(struct spsc *q, useconds_t timeout) {
+	struct pollfd pfd;
+	uint64_t n;
+	
+	if(spsc_depth(q)>0) return 1;
+	pfd.fd=q->efd;
+	pfd.events=POLLIN;
+	pfd.revents=0;
+	if(poll(&pfd, 1, timeout/1000)<=0) return 0;
+	if(read(q->efd, &n, sizeof(n))<0) {
+		// somebody else consumed the wakeup, nothing to do
+	}
+	
+	return 1;
+}
+
+/**
+ * Return how many elements are waiting in the ring
+ */
+size_t spsc_depth(struct spsc *q) {
+	return atomic_load_explicit(&q->head, memory_order_acquire)-atomic_load_explicit(&q->tail, memory_order_acquire);
+}
+
+/**
+ * Release the ring
+ */
+void spsc_destroy(struct spsc *q) {
+	if(q->efd!=-1) close(q->efd);
+	q->efd=-1;
+}
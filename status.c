@@ -0,0 +1,147 @@
+/**
+ * Author: Dino Ciuffetti - dam2000 at gmail dot com
+ * Home: https://github.com/dam2k/fanChat
+ * Date: 2019-10-27
+ * Whatis: Melopero's FanHat Raspberry Pi FAN controller daemon rethinked from scratch and written in C
+ * Work with: Melopero FAN HAT for Raspberry Pi 4
+ *   https://www.melopero.com/shop/melopero-engineering/melopero-fan-hat-for-raspberry-pi-4/
+ * Requires: PiGpio library: http://abyz.me.uk/rpi/pigpio/ - apt update && apt install libpigpio-dev
+ * Replaces: official fan driver written in python: https://www.melopero.com/fan-hat/
+ * License: MIT License - https://opensource.org/licenses/MIT
+ *
+ * Notes:
+ * The Melopero FAN HAT for Raspberry Pi 4 is a cool (freddo!! :-)) fan driver for Raspberry Pi 4. It works using GPIO PIN 18 that
+ * has hardware driven PWM capabilities. This way they can handle fan speed changing the PIN's duty cycle.
+ * We continuously read the CPU temperature thanks to the /sys/class/thermal/thermal_zone0/temp file and we take care of cooling
+ * the CPU by setting up the right fan speed modulating the pin's PWM attached to the fan hat.
+ * Since I really hate when the fan is always on at low speed, I thinked of using a high and low watermarks.
+ * If the cpu's temperature is below the LW the fan will be shut down, and when the cpu's temperature raises above the HW the fan
+ * will come into play at the right speed. Also, there is a trigger timeout that will fire if the fan is down for more then a few
+ * minutes after the LW event. In this way we can cool down the RPI's temperature a little bit without reaching the HW or
+ * stressing us too much. Enjoy it!!
+ */
+
+/**
+ * Copyright 2019 Dino Ciuffetti - dam2000 at gmail dot com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+ * IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "common.h"
+#include <stdarg.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include "status.h"
+
+static char statusfile[PATH_MAX]=STATUSFILE;
+// status report being built
+static char sbuf[4096];
+static size_t slen=0;
+// status report handed over to another thread
+static char pbuf[sizeof(sbuf)];
+static size_t plen=0;
+static atomic_int pending=ATOMIC_VAR_INIT(0);
+// don't logspam flag for status file errors
+static int sfedlsf=0;
+
+/**
+ * Set the status file path
+ */
+void status_setfile(const char *path) {
+	snprintf(statusfile, sizeof(statusfile), "%s", path);
+}
+
+/**
+ * Start a new status report
+ */
+void status_begin(void) {
+	slen=0;
+	sbuf[0]='\0';
+}
+
+/**
+ * Append a "key: value" line to the status report
+ */
+void status_add(const char *key, const char *fmt, ...) {
+	va_list ap;
+	int r;
+	
+	r=snprintf(sbuf+slen, sizeof(sbuf)-slen, "%s: ", key);
+	if(r<0 || (size_t)r>=sizeof(sbuf)-slen) return; // report is full, drop the line
+	slen+=r;
+	va_start(ap, fmt);
+	r=vsnprintf(sbuf+slen, sizeof(sbuf)-slen, fmt, ap);
+	va_end(ap);
+	if(r<0 || (size_t)r+1>=sizeof(sbuf)-slen) { // report is full, drop the line
+		slen-=strlen(key)+2;
+		sbuf[slen]='\0';
+		return;
+	}
+	slen+=r;
+	sbuf[slen++]='\n';
+	sbuf[slen]='\0';
+}
+
+// atomically replace the status file with len bytes of b
+static int status_write(const char *b, size_t len) {
+	char tmp[PATH_MAX+4];
+	int fd;
+	ssize_t r;
+	
+	snprintf(tmp, sizeof(tmp), "%s.tmp", statusfile);
+	fd=open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd<0) {
+		if(sfedlsf==0) syslog(LOG_ERR, "Cannot write status file %s: %s", tmp, strerror(errno));
+		sfedlsf=1;
+		return -1;
+	}
+	r=write(fd, b, len);
+	close(fd);
+	if(r!=(ssize_t)len || rename(tmp, statusfile)<0) {
+		if(sfedlsf==0) syslog(LOG_ERR, "Cannot write status file %s: %s", statusfile, strerror(errno));
+		sfedlsf=1;
+		unlink(tmp);
+		return -1;
+	}
+	sfedlsf=0;
+	
+	return 0;
+}
+
+/**
+ * Atomically replace the status file with the status report. Return -1 on errors or 0 on success
+ */
+int status_commit(void) {
+	return status_write(sbuf, slen);
+}
+
+/**
+ * Hand the status report over to another thread calling status_flush(). Return -1 if the previous one is still pending
+ */
+int status_publish(void) {
+	if(atomic_load_explicit(&pending, memory_order_acquire)) return -1;
+	memcpy(pbuf, sbuf, slen);
+	plen=slen;
+	atomic_store_explicit(&pending, 1, memory_order_release);
+	
+	return 0;
+}
+
+/**
+ * Write the status report handed over by status_publish(), if any
+ */
+void status_flush(void) {
+	if(!atomic_load_explicit(&pending, memory_order_acquire)) return;
+	status_write(pbuf, plen);
+	atomic_store_explicit(&pending, 0, memory_order_release);
+}
@@ -0,0 +1,123 @@
+/**
+ * Author: Dino Ciuffetti - dam2000 at gmail dot com
+ * Home: https://github.com/dam2k/fanChat
+ * Date: 2019-10-27
+ * Whatis: Melopero's FanHat Raspberry Pi FAN controller daemon rethinked from scratch and written in C
+ * Work with: Melopero FAN HAT for Raspberry Pi 4
+ *   https://www.melopero.com/shop/melopero-engineering/melopero-fan-hat-for-raspberry-pi-4/
+ * Requires: PiGpio library: http://abyz.me.uk/rpi/pigpio/ - apt update && apt install libpigpio-dev
+ * Replaces: official fan driver written in python: https://www.melopero.com/fan-hat/
+ * License: MIT License - https://opensource.org/licenses/MIT
+ *
+ * Notes:
+ * The Melopero FAN HAT for Raspberry Pi 4 is a cool (freddo!! :-)) fan driver for Raspberry Pi 4. It works using GPIO PIN 18 that
+ * has hardware driven PWM capabilities. This way they can handle fan speed changing the PIN's duty cycle.
+ * We continuously read the CPU temperature thanks to the /sys/class/thermal/thermal_zone0/temp file and we take care of cooling
+ * the CPU by setting up the right fan speed modulating the pin's PWM attached to the fan hat.
+ * Since I really hate when the fan is always on at low speed, I thinked of using a high and low watermarks.
+ * If the cpu's temperature is below the LW the fan will be shut down, and when the cpu's temperature raises above the HW the fan
+ * will come into play at the right speed. Also, there is a trigger timeout that will fire if the fan is down for more then a few
+ * minutes after the LW event. In this way we can cool down the RPI's temperature a little bit without reaching the HW or
+ * stressing us too much. Enjoy it!!
+ */
+
+/**
+ * Copyright 2019 Dino Ciuffetti - dam2000 at gmail dot com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+ * IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "common.h"
+#include <limits.h>
+#include "sysfs.h"
+
+// root directory of the kernel pseudo files, empty means the real ones
+static char sysfsroot[PATH_MAX]="";
+
+/**
+ * Set the root directory under which /proc and /sys files are looked up. Used to test fanChat against fake files
+ */
+void sysfs_setroot(const char *root) {
+	snprintf(sysfsroot, sizeof(sysfsroot), "%s", root);
+}
+
+/**
+ * Open a kernel pseudo file (procfs, sysfs, ...) below the configured root. Return the fd or -1 on errors
+ */
+int sysfs_open(const char *path, int flags) {
+	char p[PATH_MAX];
+	
+	if(sysfsroot[0]=='\0') return open(path, flags);
+	if(snprintf(p, sizeof(p), "%s%s", sysfsroot, path) >= (int)sizeof(p)) {
+		errno=ENAMETOOLONG;
+		return -1;
+	}
+	
+	return open(p, flags);
+}
+
+/**
+ * Read up to len-1 bytes from the start of fd into b, always NUL terminating it. Return bytes read or -1 on errors
+ */
+ssize_t sysfs_read(int fd, char *b, size_t len) {
+	ssize_t r;
+	
+	do {
+		r=pread(fd, b, len-1, 0);
+	} while(r<0 && errno==EINTR);
+	if(r<0) {
+		b[0]='\0';
+		return -1;
+	}
+	b[r]='\0';
+	
+	return r;
+}
+
+/**
+ * Replace the content of fd with the NUL terminated string b. Return -1 on errors or 0 on success
+ */
+int sysfs_write(int fd, const char *b) {
+	size_t len=strlen(b);
+	ssize_t r;
+	struct stat st;
+	
+	do {
+		r=pwrite(fd, b, len, 0);
+	} while(r<0 && errno==EINTR);
+	if(r!=(ssize_t)len) return -1;
+	// kernel files take the whole value, fake ones must be cut where the new value ends (kernel files ignore this)
+	if(fstat(fd, &st)==0 && st.st_size>(off_t)len && ftruncate(fd, len)<0) {
+		errno=0;
+	}
+	
+	return 0;
+}
+
+/**
+ * Parse an unsigned decimal number from p skipping leading blanks, storing it into v.
+ * Return a pointer just after the number or NULL if there is no number at p
+ */
+const char *sysfs_parseull(const char *p, unsigned long long *v) {
+	unsigned long long n=0;
+	
+	while(*p==' ' || *p=='\t') p++;
+	if(*p<'0' || *p>'9') return NULL;
+	while(*p>='0' && *p<='9') {
+		n=n*10+(*p-'0');
+		p++;
+	}
+	*v=n;
+	
+	return p;
+}
@@ -0,0 +1,232 @@
+/**
+ * Author: Dino Ciuffetti - dam2000 at gmail dot com
+ * Home: https://github.com/dam2k/fanChat
+ * Date: 2019-10-27
+ * Whatis: Melopero's FanHat Raspberry Pi FAN controller daemon rethinked from scratch and written in C
+ * Work with: Melopero FAN HAT for Raspberry Pi 4
+ *   https://www.melopero.com/shop/melopero-engineering/melopero-fan-hat-for-raspberry-pi-4/
+ * Requires: PiGpio library: http://abyz.me.uk/rpi/pigpio/ - apt update && apt install libpigpio-dev
+ * Replaces: official fan driver written in python: https://www.melopero.com/fan-hat/
+ * License: MIT License - https://opensource.org/licenses/MIT
+ *
+ * Notes:
+ * The Melopero FAN HAT for Raspberry Pi 4 is a cool (freddo!! :-)) fan driver for Raspberry Pi 4. It works using GPIO PIN 18 that
+ * has hardware driven PWM capabilities. This way they can handle fan speed changing the PIN's duty cycle.
+ * We continuously read the CPU temperature thanks to the /sys/class/thermal/thermal_zone0/temp file and we take care of cooling
+ * the CPU by setting up the right fan speed modulating the pin's PWM attached to the fan hat.
+ * Since I really hate when the fan is always on at low speed, I thinked of using a high and low watermarks.
+ * If the cpu's temperature is below the LW the fan will be shut down, and when the cpu's temperature raises above the HW the fan
+ * will come into play at the right speed. Also, there is a trigger timeout that will fire if the fan is down for more then a few
+ * minutes after the LW event. In this way we can cool down the RPI's temperature a little bit without reaching the HW or
+ * stressing us too much. Enjoy it!!
+ */
+
+/**
+ * Copyright 2019 Dino Ciuffetti - dam2000 at gmail dot com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+ * IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "common.h"
+#include <stdarg.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include "spsc.h"
+#include "status.h"
+#include "telemetry.h"
+
+// telemetry queue slots (power of two)
+#define TELEMETRYSLOTS 64
+
+#define TEV_LOG 0
+#define TEV_TITLE 1
+#define TEV_STATUS 2
+#define TEV_CALL 3
+
+// a telemetry event, from the control thread to the telemetry thread
+struct tevent {
+	int type;
+	int prio;
+	void (*fn)(void); // TEV_CALL
+	char msg[200];
+};
+
+static struct tevent tqbuf[TELEMETRYSLOTS];
+static struct spsc tq;
+static pthread_t tthread;
+static atomic_int trunning=ATOMIC_VAR_INIT(0);
+static atomic_int tstop=ATOMIC_VAR_INIT(0);
+
+static void *telemetry_thread(void *arg) {
+	struct tevent ev;
+	int stop;
+	
+	while(1) {
+		spsc_wait(&tq, 1000000);
+		stop=tstop; // before draining: whatever was queued before the stop request is handled below
+		while(spsc_pop(&tq, &ev)==0) {
+			switch(ev.type) {
+			case TEV_LOG:
+				syslog(ev.prio, "%s", ev.msg);
+				break;
+			case TEV_TITLE:
+				setproctitle("%s", ev.msg);
+				break;
+			case TEV_STATUS:
+				status_flush();
+				break;
+			case TEV_CALL:
+				ev.fn();
+				break;
+			}
+		}
+		if(stop) break;
+	}
+	status_flush(); // the last one, if still pending
+	
+	return NULL;
+}
+
+/**
+ * Start the telemetry thread: from now on logs, process title, status, checkpoint and cooling baseline files are written by it,
+ * so that slow outputs can never delay sensing or actuation. Return -1 on errors or 0 on success
+ */
+int telemetry_start(void) {
+	sigset_t all, old;
+	int ret;
+	
+	if(spsc_init(&tq, tqbuf, TELEMETRYSLOTS, sizeof(struct tevent))<0) {
+		syslog(LOG_ERR, "Cannot setup telemetry queue: %s", strerror(errno));
+		return -1;
+	}
+	// signals are for the control thread
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	tstop=0;
+	ret=pthread_create(&tthread, NULL, telemetry_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if(ret!=0) {
+		syslog(LOG_ERR, "Cannot start telemetry thread: %s", strerror(ret));
+		spsc_destroy(&tq);
+		return -1;
+	}
+	trunning=1;
+	
+	return 0;
+}
+
+/**
+ * Flush and stop the telemetry thread
+ */
+void telemetry_stop(void) {
+	uint64_t one=1;
+	
+	if(!trunning) return;
+	tstop=1;
+	if(write(tq.efd, &one, sizeof(one))<0) {
+		// the counter is saturated, the thread is awake anyway
+	}
+	pthread_join(tthread, NULL);
+	trunning=0;
+	spsc_destroy(&tq);
+}
+
+// events are queued by the control thread only, the telemetry thread itself (running a TEV_CALL) does its own output
+static int tqueued(void) {
+	return trunning && !pthread_equal(pthread_self(), tthread);
+}
+
+static void tpush(int type, int prio, const char *fmt, va_list ap) {
+	struct tevent ev;
+	
+	ev.type=type;
+	ev.prio=prio;
+	vsnprintf(ev.msg, sizeof(ev.msg), fmt, ap);
+	spsc_push(&tq, &ev); // if the queue is full the event is dropped and counted, never wait for the telemetry thread
+}
+
+/**
+ * syslog(), queued to the telemetry thread if it's running
+ */
+void tlog(int prio, const char *fmt, ...) {
+	va_list ap;
+	
+	va_start(ap, fmt);
+	if(tqueued()) {
+		tpush(TEV_LOG, prio, fmt, ap);
+	} else {
+		vsyslog(prio, fmt, ap);
+	}
+	va_end(ap);
+}
+
+/**
+ * setproctitle(), queued to the telemetry thread if it's running
+ */
+void ttitle(const char *fmt, ...) {
+	va_list ap;
+	char b[200];
+	
+	va_start(ap, fmt);
+	if(tqueued()) {
+		tpush(TEV_TITLE, 0, fmt, ap);
+	} else {
+		vsnprintf(b, sizeof(b), fmt, ap);
+		setproctitle("%s", b);
+	}
+	va_end(ap);
+}
+
+/**
+ * Commit the status report, handed over to the telemetry thread if it's running
+ */
+void tstatus(void) {
+	struct tevent ev;
+	
+	if(!tqueued()) {
+		status_commit();
+		return;
+	}
+	if(status_publish()==0) {
+		ev.type=TEV_STATUS;
+		spsc_push(&tq, &ev);
+	}
+}
+
+/**
+ * Run fn() on the telemetry thread if it's running, otherwise now. Return -1 if the queue is full (fn is not run) or 0 on success
+ */
+int tcall(void (*fn)(void)) {
+	struct tevent ev;
+	
+	if(!tqueued()) {
+		fn();
+		return 0;
+	}
+	ev.type=TEV_CALL;
+	ev.fn=fn;
+	
+	return spsc_push(&tq, &ev);
+}
+
+/**
+ * Append telemetry queue counters to the status report
+ */
+void telemetry_status(void) {
+	if(!trunning) return;
+	status_add("pipeline_telemetry_depth", "%zu", spsc_depth(&tq));
+	status_add("pipeline_telemetry_maxdepth", "%zu", atomic_load(&tq.maxdepth));
+	status_add("pipeline_telemetry_pushes", "%lu", atomic_load(&tq.pushes));
+	status_add("pipeline_telemetry_drops", "%lu", atomic_load(&tq.drops));
+}
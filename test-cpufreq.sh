@@ -0,0 +1,108 @@
+#!/bin/sh
+
+ # Author: Dino Ciuffetti - dam2000 at gmail dot com
+ # Home: https://github.com/dam2k/fanChat
+ # Whatis: check the CPU frequency ceiling (-F) without a Pi: run fanChat on fake thermal and cpufreq files and a mock register file,
+ # heat it up and cool it down, then check scaling_max_freq and its record as fanChat starts, lowers, raises and restores it
+ # Usage: ./make.sh && ./test-cpufreq.sh [path to fanChat]
+ # License: MIT License - https://opensource.org/licenses/MIT
+
+ #
+ # Copyright 2019 Dino Ciuffetti - dam2000 at gmail dot com
+ # 
+ # Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ # 
+ # The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ # 
+ # THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+FANCHAT=${1:-./fanChat}
+DIR=$(mktemp -d)
+trap 'kill $PID 2>/dev/null; rm -rf "$DIR"' EXIT
+FAIL=0
+CF="$DIR/root/sys/devices/system/cpu/cpufreq/policy0"
+TEMP="$DIR/root/sys/class/thermal/thermal_zone0/temp"
+
+# scaling_max_freq (kHz)
+ceiling() {
+	head -n1 "$CF/scaling_max_freq"
+}
+
+# report the check named $1, passed if $2 is true
+check() {
+	if [ "$2" = "1" ]; then
+		echo "ok   $1"
+	else
+		echo "FAIL $1"
+		FAIL=1
+	fi
+}
+
+# 1 if there's no lowered ceiling record
+norecord() {
+	[ -e "$DIR/state/cpufreq" ] && echo 0 || echo 1
+}
+
+# run fanChat in the background
+start() {
+	"$FANCHAT" -f -F -r "$DIR/root" -s "$DIR/status" -S "$DIR/state" -k "$DIR/checkpoint" -g "$DIR/regs" > "$DIR/log" 2>&1 &
+	PID=$!
+	sleep 2
+	if ! kill -0 $PID 2>/dev/null; then
+		cat "$DIR/log"
+		echo "FAIL fanChat is not running"
+		exit 1
+	fi
+}
+
+# stop it, as systemd does
+stop() {
+	kill -TERM $PID
+	wait $PID
+	PID=
+}
+
+mkdir -p "$CF" "$DIR/root/sys/class/thermal/thermal_zone0" "$DIR/state"
+echo 1500000 > "$CF/cpuinfo_max_freq"
+echo 600000 > "$CF/cpuinfo_min_freq"
+echo 1000000 > "$CF/scaling_max_freq" # as a killed fanChat may leave it...
+echo 1400000 > "$DIR/state/cpufreq" # ...with the record of the administrator's ceiling
+echo 60000 > "$TEMP"
+: > "$DIR/regs"
+
+start
+check "startup: restored the recorded ceiling, $(ceiling) kHz" $(($(ceiling)==1400000))
+check "startup: record removed" $(norecord)
+
+echo 81000 > "$TEMP" # written in place: fanChat keeps the file open. Above the policy maximum, the fan at its top step
+sleep 7
+C=$(ceiling)
+check "hot: lowered by 100 MHz steps, $C kHz" $((C<1400000 && C>=600000 && C%100000==0))
+check "hot: ceiling recorded, $(cat "$DIR/state/cpufreq" 2>/dev/null) kHz" $(($(cat "$DIR/state/cpufreq" 2>/dev/null || echo 0)==1400000))
+
+echo 70000 > "$TEMP"
+sleep $(((1400000-C)/100000*2+4))
+check "cool: raised back to the administrator's ceiling, $(ceiling) kHz" $(($(ceiling)==1400000))
+check "cool: record removed" $(norecord)
+
+echo 81000 > "$TEMP"
+sleep 5
+check "hot again: lowered, $(ceiling) kHz" $(($(ceiling)<1400000))
+stop
+check "shutdown: restored to the administrator's ceiling, $(ceiling) kHz" $(($(ceiling)==1400000))
+check "shutdown: record removed" $(norecord)
+check "status: $(grep '^cpufreq_events' "$DIR/status"), once per hot spell" $(grep -c '^cpufreq_events: 2$' "$DIR/status")
+check "status: $(grep '^cpufreq_benefit' "$DIR/status"), no firmware throttling seen" $(grep -c '^cpufreq_benefit: unknown$' "$DIR/status")
+
+echo 1200000 > "$CF/scaling_max_freq" # an administrator's under-clock, no record
+echo 60000 > "$TEMP"
+start
+check "under-clock: kept at startup, $(ceiling) kHz" $(($(ceiling)==1200000))
+echo 81000 > "$TEMP"
+sleep 5
+check "under-clock: lowered below it, $(ceiling) kHz" $(($(ceiling)<1200000))
+stop
+check "under-clock: restored to it, $(ceiling) kHz" $(($(ceiling)==1200000))
+
+[ $FAIL -eq 0 ] && echo "all ok"
+exit $FAIL
@@ -0,0 +1,70 @@
+#!/bin/sh
+
+ # Author: Dino Ciuffetti - dam2000 at gmail dot com
+ # Home: https://github.com/dam2k/fanChat
+ # Whatis: check the PWM driver without a Pi: run fanChat on fake sensor files and a mock register file (-g), then check the
+ # GPIO, PWM and clock manager words it wrote, while running and after shutdown
+ # Usage: ./make.sh && ./test-pwm.sh [path to fanChat]
+ # License: MIT License - https://opensource.org/licenses/MIT
+
+ #
+ # Copyright 2019 Dino Ciuffetti - dam2000 at gmail dot com
+ # 
+ # Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ # 
+ # The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ # 
+ # THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+FANCHAT=${1:-./fanChat}
+DIR=$(mktemp -d)
+trap 'kill $PID 2>/dev/null; rm -rf "$DIR"' EXIT
+FAIL=0
+
+# 32 bit word of the register page (0: GPIO, 1: PWM, 2: clock manager) at byte offset off, in hex
+word() {
+	od -An -tx4 -j $(($1*4096+$2)) -N4 "$DIR/regs" | tr -d ' '
+}
+
+# check that the word of page $1 at offset $2, masked with $3, is $4
+check() {
+	W=$(printf '%08x' $((0x$(word $1 $2) & $3)))
+	if [ "$W" = "$(printf '%08x' $4)" ]; then
+		echo "ok   $5: $W"
+	else
+		echo "FAIL $5: $W, expected $(printf '%08x' $4)"
+		FAIL=1
+	fi
+}
+
+mkdir -p "$DIR/root/sys/class/thermal/thermal_zone0"
+echo 75000 > "$DIR/root/sys/class/thermal/thermal_zone0/temp" # above the high watermark: the fan runs
+: > "$DIR/regs" # fanChat sizes it to the 3 pages
+
+"$FANCHAT" -f -r "$DIR/root" -s "$DIR/status" -S "$DIR/state" -k "$DIR/checkpoint" -g "$DIR/regs" > "$DIR/log" 2>&1 &
+PID=$!
+sleep 5
+if ! kill -0 $PID 2>/dev/null; then
+	cat "$DIR/log"
+	echo "FAIL fanChat is not running"
+	exit 1
+fi
+FAN=$(sed -n 's/^fan: //p' "$DIR/status")
+echo "fan at ${FAN}%"
+
+check 0 0x04 0x07000000 0x02000000 "GPFSEL1: GPIO18 is ALT5, the PWM"
+check 1 0x00 0xFF 0x81 "PWM CTL: channel 1 enabled, mark-space"
+check 1 0x10 0xFFFFFFFF 1000 "PWM RNG1: 1000 duty steps"
+check 1 0x14 0xFFFFFFFF $((FAN*10)) "PWM DAT1: the fan speed"
+check 2 0xA0 0xFF 0x11 "CM PWMCTL: clock enabled, from the oscillator"
+check 2 0xA4 0xFFFFFFFF $((0x5A000000 | 24<<12)) "CM PWMDIV: 19.2 MHz / 24 = 800 Hz * 1000 steps"
+
+# a shutdown with a checkpoint leaves the fan running for the restart to take over
+kill -TERM $PID
+wait $PID
+PID=
+check 0 0x04 0x07000000 0x02000000 "GPFSEL1 after shutdown: still the PWM"
+check 1 0x14 0xFFFFFFFF $((FAN*10)) "PWM DAT1 after shutdown: still the fan speed"
+
+[ $FAIL -eq 0 ] && echo "all ok"
+exit $FAIL
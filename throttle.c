@@ -0,0 +1,213 @@
+/**
+ * Author: Dino Ciuffetti - dam2000 at gmail dot com
+ * Home: https://github.com/dam2k/fanChat
+ * Date: 2019-10-27
+ * Whatis: Melopero's FanHat Raspberry Pi FAN controller daemon rethinked from scratch and written in C
+ * Work with: Melopero FAN HAT for Raspberry Pi 4
+ *   https://www.melopero.com/shop/melopero-engineering/melopero-fan-hat-for-raspberry-pi-4/
+ * Requires: PiGpio library: http://abyz.me.uk/rpi/pigpio/ - apt update && apt install libpigpio-dev
+ * Replaces: official fan driver written in python: https://www.melopero.com/fan-hat/
+ * License: MIT License - https://opensource.org/licenses/MIT
+ *
+ * Notes:
+ * The Melopero FAN HAT for Raspberry Pi 4 is a cool (freddo!! :-)) fan driver for Raspberry Pi 4. It works using GPIO PIN 18 that
+ * has hardware driven PWM capabilities. This way they can handle fan speed changing the PIN's duty cycle.
+ * We continuously read the CPU temperature thanks to the /sys/class/thermal/thermal_zone0/temp file and we take care of cooling
+ * the CPU by setting up the right fan speed modulating the pin's PWM attached to the fan hat.
+ * Since I really hate when the fan is always on at low speed, I thinked of using a high and low watermarks.
+ * If the cpu's temperature is below the LW the fan will be shut down, and when the cpu's temperature raises above the HW the fan
+ * will come into play at the right speed. Also, there is a trigger timeout that will fire if the fan is down for more then a few
+ * minutes after the LW event. In this way we can cool down the RPI's temperature a little bit without reaching the HW or
+ * stressing us too much. Enjoy it!!
+ */
+
+/**
+ * Copyright 2019 Dino Ciuffetti - dam2000 at gmail dot com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+ * IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "common.h"
+#include <time.h>
+#include "sysfs.h"
+#include "status.h"
+#include "telemetry.h"
+#include "throttle.h"
+
+// firmware get_throttled value, exposed by the raspberrypi firmware driver
+#define GETTHROTTLEDFILE "/sys/devices/platform/soc/soc:firmware/get_throttled"
+#define CPUFREQFILE "/sys/devices/system/cpu/cpu0/cpufreq/scaling_cur_freq"
+
+// get_throttled bits 0-3 are "happening now", bits 16-19 are "happened since boot"
+#define THROTTLEEVENTS 4
+#define THROTTLEOCCURREDSHIFT 16
+// the events where the firmware lowers the CPU frequency
+#define THROTTLESLOWBITS 0xe
+
+static const struct {
+	unsigned long bit;
+	const char *name; // for logs
+	const char *key; // for status
+} tevents[THROTTLEEVENTS] = {
+	{ 0x1, "under-voltage", "undervoltage" },
+	{ 0x2, "ARM frequency capping", "freqcap" },
+	{ 0x4, "throttling", "throttled" },
+	{ 0x8, "soft temperature limit", "softlimit" },
+};
+
+// per event statistics
+static struct {
+	unsigned long count; // how many times it started
+	double secs; // how long it lasted overall
+	double T; // temperature when it last started
+	int p; // fan speed when it last started
+	unsigned long mhz; // CPU frequency when it last started
+	struct timespec t; // when it last started
+} tstats[THROTTLEEVENTS];
+
+static int throttledfd=-1;
+static int cpufreqfd=-1;
+static unsigned long flags=0; // last get_throttled value
+static unsigned long curfreq=0; // last CPU frequency (kHz)
+static struct timespec tlast; // last sample time
+static unsigned long samples=0;
+static double thrsecs=0; // how long the firmware lowered the frequency, while it was known
+static double thrkhzsecs=0; // work done meanwhile (kHz*s)
+
+/**
+ * Open the firmware throttled bitmask and cpufreq files. Return -1 if none of them is available
+ */
+int throttle_open(void) {
+	char b[32];
+	int i;
+	
+	throttledfd=sysfs_open(GETTHROTTLEDFILE, O_RDONLY);
+	if(throttledfd<0) {
+		syslog(LOG_NOTICE, "Firmware throttling state not available (%s): %s", GETTHROTTLEDFILE, strerror(errno));
+	} else if(sysfs_read(throttledfd, b, sizeof(b))>0) {
+		// report what happened before we were started
+		flags=strtoul(b, NULL, 16);
+		for(i=0; i<THROTTLEEVENTS; i++) {
+			if(flags & (tevents[i].bit<<THROTTLEOCCURREDSHIFT)) {
+				syslog(LOG_WARNING, "Firmware reports %s occurred since boot", tevents[i].name);
+			}
+		}
+		flags=0;
+	}
+	cpufreqfd=sysfs_open(CPUFREQFILE, O_RDONLY);
+	if(cpufreqfd<0) {
+		syslog(LOG_NOTICE, "CPU frequency not available (%s): %s", CPUFREQFILE, strerror(errno));
+	}
+	clock_gettime(CLOCK_BOOTTIME, &tlast);
+	
+	return (throttledfd<0 && cpufreqfd<0) ? -1 : 0;
+}
+
+/**
+ * close file descriptors
+ */
+void throttle_close(void) {
+	if(throttledfd!=-1) close(throttledfd);
+	if(cpufreqfd!=-1) close(cpufreqfd);
+	throttledfd=cpufreqfd=-1;
+}
+
+/**
+ * Sample the firmware throttling state and the CPU frequency, tying new events to the temperature T and the fan speed p.
+ * Return the number of new throttling events, or -1 on errors
+ */
+int throttle_sample(double T, int p) {
+	char b[32];
+	unsigned long f;
+	struct timespec now;
+	double dt;
+	int i, n=0;
+	
+	if(throttledfd<0 && cpufreqfd<0) return -1;
+	clock_gettime(CLOCK_BOOTTIME, &now);
+	dt=(now.tv_sec-tlast.tv_sec)+(now.tv_nsec-tlast.tv_nsec)/1e9;
+	tlast=now;
+	samples++;
+	
+	if((flags & THROTTLESLOWBITS) && curfreq>0) { // the frequency sampled with them held over the last interval
+		thrsecs+=dt;
+		thrkhzsecs+=curfreq*dt;
+	}
+	if(cpufreqfd>=0 && sysfs_read(cpufreqfd, b, sizeof(b))>0) {
+		curfreq=strtoul(b, NULL, 10);
+	}
+	if(throttledfd<0 || sysfs_read(throttledfd, b, sizeof(b))<=0) return 0;
+	f=strtoul(b, NULL, 16);
+	
+	for(i=0; i<THROTTLEEVENTS; i++) {
+		if(flags & tevents[i].bit) { // was active on the previous sample
+			tstats[i].secs+=dt;
+		}
+		if((f & tevents[i].bit) && !(flags & tevents[i].bit)) { // just started
+			n++;
+			tstats[i].count++;
+			tstats[i].T=T;
+			tstats[i].p=p;
+			tstats[i].mhz=curfreq/1000;
+			tstats[i].t=now;
+			tlog(LOG_WARNING, "Firmware %s started (0x%lx). Temp %2.1f C, fan at %d%%, CPU at %lu MHz (%lu times so far)",
+				tevents[i].name, f, T, p, curfreq/1000, tstats[i].count);
+		}
+		if(!(f & tevents[i].bit) && (flags & tevents[i].bit)) { // just ended
+			tlog(LOG_NOTICE, "Firmware %s ended after %lds. Temp %2.1f C, fan at %d%%", tevents[i].name,
+				(long)(now.tv_sec-tstats[i].t.tv_sec), T, p);
+		}
+	}
+	flags=f;
+	
+	return n;
+}
+
+/**
+ * Return the current CPU frequency in kHz as of the last sample, 0 if unknown
+ */
+unsigned long throttle_curfreq(void) {
+	return curfreq;
+}
+
+/**
+ * Return the time weighted mean CPU frequency in kHz while the firmware was lowering it, 0 if it never did
+ */
+unsigned long throttle_throttledfreq(void) {
+	return (thrsecs>0) ? (unsigned long)(thrkhzsecs/thrsecs) : 0;
+}
+
+/**
+ * Append throttling counters to the status report
+ */
+void throttle_status(void) {
+	char k[48];
+	int i;
+	
+	if(throttledfd<0 && cpufreqfd<0) return;
+	status_add("cpu_mhz", "%lu", curfreq/1000);
+	if(throttledfd<0) return;
+	status_add("throttled", "0x%lx", flags);
+	status_add("throttle_samples", "%lu", samples);
+	if(thrsecs>0) status_add("throttled_mean_mhz", "%lu", throttle_throttledfreq()/1000);
+	for(i=0; i<THROTTLEEVENTS; i++) {
+		snprintf(k, sizeof(k), "%s_events", tevents[i].key);
+		status_add(k, "%lu", tstats[i].count);
+		snprintf(k, sizeof(k), "%s_seconds", tevents[i].key);
+		status_add(k, "%.1f", tstats[i].secs);
+		if(tstats[i].count>0) {
+			snprintf(k, sizeof(k), "%s_last", tevents[i].key);
+			status_add(k, "temp=%.1f fan=%d mhz=%lu", tstats[i].T, tstats[i].p, tstats[i].mhz);
+		}
+	}
+}
@@ -0,0 +1,596 @@
+/**
+ * Author: Dino Ciuffetti - dam2000 at gmail dot com
+ * Home: https://github.com/dam2k/fanChat
+ * Date: 2019-10-27
+ * Whatis: Melopero's FanHat Raspberry Pi FAN controller daemon rethinked from scratch and written in C
+ * Work with: Melopero FAN HAT for Raspberry Pi 4
+ *   https://www.melopero.com/shop/melopero-engineering/melopero-fan-hat-for-raspberry-pi-4/
+ * Requires: PiGpio library: http://abyz.me.uk/rpi/pigpio/ - apt update && apt install libpigpio-dev
+ * Replaces: official fan driver written in python: https://www.melopero.com/fan-hat/
+ * License: MIT License - https://opensource.org/licenses/MIT
+ *
+ * Notes:
+ * The Melopero FAN HAT for Raspberry Pi 4 is a cool (freddo!! :-)) fan driver for Raspberry Pi 4. It works using GPIO PIN 18 that
+ * has hardware driven PWM capabilities. This way they can handle fan speed changing the PIN's duty cycle.
+ * We continuously read the CPU temperature thanks to the /sys/class/thermal/thermal_zone0/temp file and we take care of cooling
+ * the CPU by setting up the right fan speed modulating the pin's PWM attached to the fan hat.
+ * Since I really hate when the fan is always on at low speed, I thinked of using a high and low watermarks.
+ * If the cpu's temperature is below the LW the fan will be shut down, and when the cpu's temperature raises above the HW the fan
+ * will come into play at the right speed. Also, there is a trigger timeout that will fire if the fan is down for more then a few
+ * minutes after the LW event. In this way we can cool down the RPI's temperature a little bit without reaching the HW or
+ * stressing us too much. Enjoy it!!
+ */
+
+/**
+ * Copyright 2019 Dino Ciuffetti - dam2000 at gmail dot com
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR
+ * IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+  fanChat-tune: search the temperature policy (watermarks, trigger timeout, fan speed curve, sampling) on recorded traces.
+  Every candidate policy drives a thermal model fitted on the traces, replaying the recorded CPU load, and is scored on fan-on
+  time, fan speed transitions, peak temperature and time above the throttle limit. Candidates are simulated in parallel on all
+  cores by a work-stealing pool, and the Pareto-optimal ones are written as policy files for fanChat -C.
+*/
+
+#include "common.h"
+#include <math.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include "policy.h"
+
+// traces farther apart than this (seconds) are different runs: the simulation starts over
+#define TRACEGAP 300.0
+// default ambient temperature (C) for the thermal model
+#define AMBIENT 25.0
+// default throttle limit (C)
+#define THROTTLELIMIT 80.0
+// default number of candidate policies
+#define CANDIDATES 1024
+// default output files prefix
+#define OUTPREFIX "fanChat-tune"
+
+// a trace sample: time (seconds), temperature (C), sustained load (0..1), fan speed (%)
+struct tsample {
+	double t;
+	float T, L, p;
+	int start; // a new run starts here
+};
+
+/*
+  Thermal model, Newton's law of cooling with the CPU load as heat source:
+  dT/dt = heat + heatload*L - (passive + fan*p/100)*(T - ambient)
+*/
+struct model {
+	double ambient, heat, heatload, passive, fan;
+};
+
+// scores of a policy, all of them the lower the better
+struct score {
+	double fanon; // seconds with the fan on
+	double transitions; // fan speed changes
+	double peak; // peak temperature (C)
+	double above; // seconds above the throttle limit
+};
+
+struct candidate {
+	struct policy pol;
+	struct score sc;
+};
+
+// a worker's share of the candidates, [lo, hi): the owner takes from lo, thieves from hi
+struct deque {
+	pthread_mutex_t m;
+	size_t lo, hi;
+	unsigned long steals;
+};
+
+static struct tsample *trace=NULL;
+static size_t ntrace=0;
+static struct model mdl;
+static double limit=THROTTLELIMIT;
+static struct candidate *cands;
+static struct deque *deques;
+static int nworkers;
+
+static void usage(const char *argv0) {
+	fprintf(stderr, "Usage: %s [-h] [-a ambient] [-C policy] [-j threads] [-l limit] [-m model] [-n candidates] [-o prefix] [-s seed] trace...\n", argv0);
+	fprintf(stderr, "  -a ambient     ambient temperature for the thermal model (default: %.1f)\n", AMBIENT);
+	fprintf(stderr, "  -C policy      start from this policy instead of the built in one\n");
+	fprintf(stderr, "  -h             show this help\n");
+	fprintf(stderr, "  -j threads     simulate on this many threads (default: all cores)\n");
+	fprintf(stderr, "  -l limit       throttle limit temperature (default: %.1f)\n", THROTTLELIMIT);
+	fprintf(stderr, "  -m model       use this thermal model instead of fitting one on the traces\n");
+	fprintf(stderr, "  -n candidates  how many policies to try (default: %d)\n", CANDIDATES);
+	fprintf(stderr, "  -o prefix      write the Pareto-optimal policies to prefix-N.conf and the model to prefix.model (default: %s)\n", OUTPREFIX);
+	fprintf(stderr, "  -s seed        random seed of the search (default: 1)\n");
+	fprintf(stderr, "A trace has a line per sample: seconds, temperature (C), load (%%) and fan speed (%%)\n");
+}
+
+/**
+ * Append the trace file path to the samples. Return -1 on errors or 0 on success
+ */
+static int trace_load(const char *path) {
+	FILE *f;
+	char line[256];
+	double t, T, L, p;
+	size_t size=ntrace, n=0, first=ntrace;
+	struct tsample *s;
+	
+	f=fopen(path, "r");
+	if(f==NULL) {
+		fprintf(stderr, "Cannot open trace %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	while(fgets(line, sizeof(line), f)!=NULL) {
+		n++;
+		line[strcspn(line, "#\n")]='\0';
+		if(line[strspn(line, " \t\r")]=='\0') continue;
+		if(sscanf(line, "%lf %lf %lf %lf", &t, &T, &L, &p)!=4) {
+			fprintf(stderr, "Invalid trace %s at line %zu\n", path, n);
+			fclose(f);
+			return -1;
+		}
+		if(ntrace>first && t<=trace[ntrace-1].t) continue; // clock went back, skip
+		if(ntrace==size) {
+			size=(size>0) ? size*2 : 65536;
+			s=realloc(trace, size*sizeof(*s));
+			if(s==NULL) {
+				fprintf(stderr, "Out of memory loading trace %s\n", path);
+				fclose(f);
+				return -1;
+			}
+			trace=s;
+		}
+		trace[ntrace].t=t;
+		trace[ntrace].T=T;
+		trace[ntrace].L=L/100;
+		trace[ntrace].p=p;
+		trace[ntrace].start=(ntrace==first || t-trace[ntrace-1].t>TRACEGAP); // never glue two files or runs together
+		ntrace++;
+	}
+	fclose(f);
+	
+	return 0;
+}
+
+/**
+ * Load the thermal model from path (key=value lines). Return -1 on errors or 0 on success
+ */
+static int model_load(const char *path, struct model *m) {
+	FILE *f;
+	char line[256], k[32];
+	double v;
+	int bad=0;
+	
+	f=fopen(path, "r");
+	if(f==NULL) {
+		fprintf(stderr, "Cannot open model %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	while(!bad && fgets(line, sizeof(line), f)!=NULL) {
+		line[strcspn(line, "#\n")]='\0';
+		if(line[strspn(line, " \t\r")]=='\0') continue;
+		if(sscanf(line, " %31[a-z] = %lf", k, &v)!=2) bad=1;
+		else if(strcmp(k, "ambient")==0) m->ambient=v;
+		else if(strcmp(k, "heat")==0) m->heat=v;
+		else if(strcmp(k, "heatload")==0) m->heatload=v;
+		else if(strcmp(k, "passive")==0) m->passive=v;
+		else if(strcmp(k, "fan")==0) m->fan=v;
+		else bad=1;
+	}
+	fclose(f);
+	if(bad || m->passive<=0 || m->fan<0) {
+		fprintf(stderr, "Invalid model %s\n", path);
+		return -1;
+	}
+	
+	return 0;
+}
+
+static void model_write(FILE *f, const struct model *m) {
+	fprintf(f, "ambient=%.2f\nheat=%.6g\nheatload=%.6g\npassive=%.6g\nfan=%.6g\n", m->ambient, m->heat, m->heatload, m->passive, m->fan);
+}
+
+/**
+ * Fit the thermal model on the traces (least squares), the ambient temperature given. Return -1 on errors or 0 on success
+ */
+static int model_fit(struct model *m) {
+	double A[4][5]={{0}}, x[4], y, dt, Tm, r;
+	size_t i, n=0;
+	int j, k, piv;
+	
+	for(i=1; i+1<ntrace; i++) {
+		if(trace[i].start || trace[i+1].start) continue;
+		// central difference: the noise of the sample doesn't leak into its slope
+		dt=trace[i+1].t-trace[i-1].t;
+		y=(trace[i+1].T-trace[i-1].T)/dt;
+		Tm=trace[i].T-m->ambient;
+		x[0]=1;
+		x[1]=trace[i].L;
+		x[2]=-Tm;
+		x[3]=-trace[i].p/100*Tm;
+		for(j=0; j<4; j++) {
+			for(k=0; k<4; k++) A[j][k]+=x[j]*x[k];
+			A[j][4]+=x[j]*y;
+		}
+		n++;
+	}
+	// solve the normal equations, gaussian elimination with partial pivoting
+	for(j=0; j<4; j++) {
+		piv=j;
+		for(k=j+1; k<4; k++) {
+			if(fabs(A[k][j])>fabs(A[piv][j])) piv=k;
+		}
+		if(fabs(A[piv][j])<1e-9*(n+1)) {
+			fprintf(stderr, "Cannot fit a thermal model: the traces need the fan both on and off and some load changes, or give one with -m\n");
+			return -1;
+		}
+		for(k=0; k<5; k++) {
+			r=A[j][k];
+			A[j][k]=A[piv][k];
+			A[piv][k]=r;
+		}
+		for(k=0; k<4; k++) {
+			if(k==j) continue;
+			r=A[k][j]/A[j][j];
+			for(i=j; i<5; i++) A[k][i]-=r*A[j][i];
+		}
+	}
+	m->heat=A[0][4]/A[0][0];
+	m->heatload=A[1][4]/A[1][1];
+	m->passive=A[2][4]/A[2][2];
+	m->fan=A[3][4]/A[3][3];
+	if(m->passive<=0 || m->fan<0) {
+		fprintf(stderr, "The thermal model fitted on the traces makes no sense (passive %g, fan %g), give one with -m\n", m->passive, m->fan);
+		return -1;
+	}
+	
+	return 0;
+}
+
+/**
+ * Drive the thermal model with the candidate policy over the traces, replaying the recorded load, and score it.
+ * The policy rounds mirror the controller: watermarks, trigger timeout (and full speed after twice it, not counting the time the
+ * dwell held the fan off), load feedforward, dwell times.
+ */
+static void simulate(struct candidate *c) {
+	const struct policy *pol=&c->pol;
+	struct score sc={0, 0, -INFINITY, 0};
+	size_t i=0, j;
+	double t, tend, tnext, T, T0, LWT, et, su, dt, k, Teq, tr;
+	int pd, fp, fan, ret, urgent, held;
+	struct dwell dw;
+	
+	while(i<ntrace) {
+		for(j=i+1; j<ntrace && !trace[j].start; j++); // this run is [i, j)
+		// start from the recorded temperature with the fan off, like fanChat does
+		t=trace[i].t;
+		tend=trace[j-1].t;
+		T=trace[i].T;
+		if(T>sc.peak) sc.peak=T;
+		LWT=t;
+		pd=0;
+		fan=0;
+		memset(&dw, 0, sizeof(dw));
+		while(t<tend) {
+			// a policy round
+			ret=policy_speedbytemp(pol, T);
+			if(T>=pol->HW) pd=ret;
+			if(T<=pol->LW) {
+				LWT=t;
+				pd=ret;
+			}
+			et=t-LWT;
+			urgent=(T>=pol->HW);
+			if(et>=pol->TTT) {
+				if(et>pol->TTT*2) {
+					ret=100;
+					urgent=1;
+				}
+				pd=ret;
+			}
+			fp=policy_speedbyload(pol, T, trace[i].L);
+			if(fp>pd) {
+				urgent=1;
+			} else {
+				fp=pd;
+			}
+			held=(fp>0);
+			fp=policy_dwell(pol, &dw, T, t, fp, urgent);
+			held=(held && fp==0);
+			if(fp!=fan) sc.transitions++;
+			fan=fp;
+			su=policy_sleep(pol, T)/1e6;
+			
+			// the temperature until the next round, exact between trace samples (fan and load are constant)
+			tnext=(t+su<tend) ? t+su : tend;
+			tr=t;
+			k=mdl.passive+mdl.fan*fan/100;
+			while(t<tnext) {
+				dt=((i+1<j && trace[i+1].t<tnext) ? trace[i+1].t : tnext)-t;
+				Teq=mdl.ambient+(mdl.heat+mdl.heatload*trace[i].L)/k;
+				T0=T;
+				T=Teq+(T0-Teq)*exp(-k*dt);
+				if(fan>0) sc.fanon+=dt;
+				if(T0>limit || T>limit) sc.above+=(T0>limit && T>limit) ? dt : dt/2;
+				if(T>sc.peak) sc.peak=T; // monotonic between samples, the ends are enough
+				t+=dt;
+				while(i+1<j && trace[i+1].t<=t) i++;
+			}
+			if(held) LWT+=t-tr; // the fan off on purpose is no stall
+		}
+		i=j;
+	}
+	c->sc=sc;
+}
+
+/**
+ * Next candidate for worker w: its own first, then the upper half of the busiest worker's share.
+ * Return -1 when there is no work left or 0 on success
+ */
+static int pool_next(int w, size_t *c) {
+	struct deque *d=&deques[w], *v;
+	size_t n, best, half;
+	int i, victim;
+	
+	pthread_mutex_lock(&d->m);
+	if(d->lo<d->hi) {
+		*c=d->lo++;
+		pthread_mutex_unlock(&d->m);
+		return 0;
+	}
+	pthread_mutex_unlock(&d->m);
+	
+	while(1) {
+		victim=-1;
+		best=0;
+		for(i=0; i<nworkers; i++) {
+			if(i==w) continue;
+			pthread_mutex_lock(&deques[i].m);
+			n=deques[i].hi-deques[i].lo;
+			pthread_mutex_unlock(&deques[i].m);
+			if(n>best) {
+				best=n;
+				victim=i;
+			}
+		}
+		if(victim<0) return -1;
+		
+		v=&deques[victim];
+		pthread_mutex_lock(&v->m);
+		n=v->hi-v->lo;
+		half=(n+1)/2;
+		v->hi-=half;
+		*c=v->hi; // the first stolen one
+		pthread_mutex_unlock(&v->m);
+		if(half==0) continue; // someone was faster, look again
+		
+		pthread_mutex_lock(&d->m);
+		d->lo=*c+1;
+		d->hi=*c+half;
+		d->steals++;
+		pthread_mutex_unlock(&d->m);
+		return 0;
+	}
+}
+
+static void *worker(void *arg) {
+	int w=(int)(intptr_t)arg;
+	size_t c;
+	
+	while(pool_next(w, &c)==0) {
+		simulate(&cands[c]);
+	}
+	
+	return NULL;
+}
+
+// random number in [a, b), xorshift64
+static double rnd(uint64_t *s, double a, double b) {
+	*s^=*s<<13;
+	*s^=*s>>7;
+	*s^=*s<<17;
+	return a+(b-a)*(*s>>11)/9007199254740992.0;
+}
+
+// a random policy in a sensible range
+static void randompolicy(uint64_t *s, struct policy *pol) {
+	double s0, g;
+	int i;
+	
+	pol->LW=rnd(s, 50, 65);
+	pol->HW=rnd(s, pol->LW+2, pol->LW+15);
+	pol->max=rnd(s, pol->HW+2, 86);
+	pol->TTT=(time_t)rnd(s, 30, 900);
+	s0=rnd(s, 20, 60); // fan speed curve: from s0% on step 0 to 100% on step 10, concave or convex
+	g=rnd(s, 0.5, 2);
+	for(i=0; i<POLICYSTEPS; i++) {
+		pol->steps[i]=(int)(s0+(100-s0)*pow(i/10.0, g)+0.5);
+	}
+	pol->sampling=rnd(s, 0.5, 2);
+	pol->minon=rnd(s, 0, 300);
+	pol->minoff=rnd(s, 0, 300);
+	pol->budget=rnd(s, 0, 3000);
+}
+
+// a dominates b: not worse on any score and better on one
+static int dominates(const struct score *a, const struct score *b) {
+	if(a->fanon>b->fanon || a->transitions>b->transitions || a->peak>b->peak || a->above>b->above) return 0;
+	return a->fanon<b->fanon || a->transitions<b->transitions || a->peak<b->peak || a->above<b->above;
+}
+
+static int byfanon(const void *a, const void *b) {
+	const struct candidate *x=&cands[*(const size_t *)a], *y=&cands[*(const size_t *)b];
+	
+	return (x->sc.fanon>y->sc.fanon)-(x->sc.fanon<y->sc.fanon);
+}
+
+static void printscore(FILE *f, const char *prefix, const struct score *sc, double secs) {
+	fprintf(f, "%sfan on %.1f%%, %.1f transitions/hour, peak %.1f C, %.0f s above %.1f C\n", prefix, sc->fanon*100/secs,
+		sc->transitions*3600/secs, sc->peak, sc->above, limit);
+}
+
+int main(int argc, char *argv[]) {
+	int ret, i, started;
+	size_t ncands=CANDIDATES, n, c, nfront, *front;
+	const char *prefix=OUTPREFIX, *modelfile=NULL;
+	char path[4096];
+	struct policy base=policy_default;
+	uint64_t seed=1;
+	pthread_t *threads;
+	struct timespec t0, t1;
+	unsigned long steals=0;
+	double secs=0;
+	FILE *f;
+	
+	mdl.ambient=AMBIENT;
+	nworkers=(int)sysconf(_SC_NPROCESSORS_ONLN);
+	while((ret=getopt(argc, argv, "a:C:hj:l:m:n:o:s:"))!=-1) {
+		switch(ret) {
+		case 'a':
+			mdl.ambient=atof(optarg);
+			break;
+		case 'C':
+			if(policy_load(optarg, &base)<0) {
+				return 1;
+			}
+			break;
+		case 'j':
+			nworkers=atoi(optarg);
+			break;
+		case 'l':
+			limit=atof(optarg);
+			break;
+		case 'm':
+			modelfile=optarg;
+			break;
+		case 'n':
+			ncands=strtoul(optarg, NULL, 10);
+			break;
+		case 'o':
+			prefix=optarg;
+			break;
+		case 's':
+			seed=strtoull(optarg, NULL, 10);
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if(optind>=argc || ncands<1) {
+		usage(argv[0]);
+		return 1;
+	}
+	if(nworkers<1) nworkers=1;
+	if(seed==0) seed=1; // xorshift gets stuck on 0
+	
+	for(i=optind; i<argc; i++) {
+		if(trace_load(argv[i])<0) return 1;
+	}
+	for(c=1; c<ntrace; c++) {
+		if(!trace[c].start) secs+=trace[c].t-trace[c-1].t;
+	}
+	if(secs<=0) {
+		fprintf(stderr, "The traces are empty\n");
+		return 1;
+	}
+	if(modelfile!=NULL) {
+		if(model_load(modelfile, &mdl)<0) return 1;
+	} else {
+		if(model_fit(&mdl)<0) return 1;
+	}
+	printf("%zu samples, %.1f hours of traces. Thermal model:\n", ntrace, secs/3600);
+	model_write(stdout, &mdl);
+	
+	// the candidates: the starting policy and random ones
+	cands=calloc(ncands, sizeof(*cands));
+	front=calloc(ncands, sizeof(*front));
+	deques=calloc(nworkers, sizeof(*deques));
+	threads=calloc(nworkers, sizeof(*threads));
+	if(cands==NULL || front==NULL || deques==NULL || threads==NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	cands[0].pol=base;
+	for(c=1; c<ncands; c++) {
+		randompolicy(&seed, &cands[c].pol);
+	}
+	
+	// simulate them all, every worker starting with an equal share
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for(i=0; i<nworkers; i++) {
+		pthread_mutex_init(&deques[i].m, NULL);
+		deques[i].lo=ncands*i/nworkers;
+		deques[i].hi=ncands*(i+1)/nworkers;
+	}
+	for(started=0; started<nworkers; started++) {
+		ret=pthread_create(&threads[started], NULL, worker, (void *)(intptr_t)started);
+		if(ret!=0) {
+			fprintf(stderr, "Cannot start worker %d: %s\n", started, strerror(ret));
+			break;
+		}
+	}
+	if(started<nworkers) { // this thread takes the share of the workers that didn't start, stealing the rest as usual
+		worker((void *)(intptr_t)started);
+	}
+	for(i=0; i<started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	for(i=0; i<nworkers; i++) {
+		steals+=deques[i].steals;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	printf("%zu policies simulated in %.1f s on %d threads (%lu steals)\n", ncands,
+		(t1.tv_sec-t0.tv_sec)+(t1.tv_nsec-t0.tv_nsec)/1e9, (started<nworkers) ? started+1 : started, steals);
+	printscore(stdout, "Starting policy: ", &cands[0].sc, secs);
+	
+	// the Pareto front
+	nfront=0;
+	for(c=0; c<ncands; c++) {
+		for(n=0; n<ncands; n++) {
+			if(dominates(&cands[n].sc, &cands[c].sc)) break;
+		}
+		if(n==ncands) front[nfront++]=c;
+	}
+	qsort(front, nfront, sizeof(*front), byfanon);
+	printf("%zu Pareto-optimal policies:\n", nfront);
+	for(n=0; n<nfront; n++) {
+		snprintf(path, sizeof(path), "%s-%zu.conf", prefix, n+1);
+		f=fopen(path, "w");
+		if(f==NULL) {
+			fprintf(stderr, "Cannot write %s: %s\n", path, strerror(errno));
+			return 1;
+		}
+		printscore(f, "# ", &cands[front[n]].sc, secs);
+		policy_write(f, &cands[front[n]].pol);
+		fclose(f);
+		printf("%s%s: ", path, (front[n]==0) ? " (starting policy)" : "");
+		printscore(stdout, "", &cands[front[n]].sc, secs);
+	}
+	snprintf(path, sizeof(path), "%s.model", prefix);
+	f=fopen(path, "w");
+	if(f!=NULL) {
+		model_write(f, &mdl);
+		fclose(f);
+	}
+	
+	return 0;
+}